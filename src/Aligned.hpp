@@ -0,0 +1,28 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+
+constexpr size_t cacheLineSize = 64;
+
+inline size_t roundUpToCacheLine(size_t bytes) { return (bytes + cacheLineSize - 1) / cacheLineSize * cacheLineSize; }
+
+struct FreeDeleter {
+  void operator()(void *pointer) const { std::free(pointer); }
+};
+
+// A zero-initialized array starting at a cache line boundary.
+template <typename T>
+using AlignedArray = std::unique_ptr<T[], FreeDeleter>;
+
+template <typename T>
+AlignedArray<T> makeAlignedArray(size_t size) {
+  const size_t bytes = std::max(cacheLineSize, roundUpToCacheLine(size * sizeof(T)));
+  void *pointer = std::aligned_alloc(cacheLineSize, bytes);
+  if (pointer == nullptr) throw std::bad_alloc();
+  std::memset(pointer, 0, bytes);
+  return AlignedArray<T>(static_cast<T *>(pointer));
+}
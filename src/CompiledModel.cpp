@@ -0,0 +1 @@
+#include "CompiledModel.hpp"
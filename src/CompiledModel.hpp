@@ -0,0 +1,256 @@
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include "Aligned.hpp"
+#include "KernelFunction.hpp"
+#include "SVM.h"
+
+// An svm_model flattened into one aligned block for inference.
+//
+// The SVs are the rows of a dense matrix padded to whole cache lines, the coefficients of each class pair are contiguous
+// (the ones of the SVs of the first class followed by the ones of the SVs of the second class), and the class start offsets are
+// precomputed, so a prediction streams through a few arrays front to back instead of following pointers.
+// The SVs and the input are stored as svm_value, so a float build streams half the bytes, and their dot products are accumulated in double
+// like Kernel::dot does, so both builds compute the kernel values of svm_predict up to rounding.
+//
+// Only classification models with linear, polynomial, RBF or sigmoid kernels can be compiled.
+// The classes are decided like svm_predict_mode does with the decision mode given when compiling: MAX_WINS, EARLY_EXIT or DAG.
+class CompiledModel {
+  int decisionMode;
+  int kernelType;
+  int degree;
+  double gamma;
+  double coef0;
+  size_t classCount;
+  size_t svCount;
+  size_t dimension;
+  size_t stride;
+  AlignedArray<unsigned char> block;
+  size_t blockSize = 0;
+  svm_value *svs = nullptr;       // svCount x stride
+  double *svSquares = nullptr;    // svCount
+  double *coefficients = nullptr; // for each pair (i, j), nSV[i] + nSV[j]
+  double *rhos = nullptr;         // pairCount
+  int *labels = nullptr;          // classCount
+  int *starts = nullptr;          // classCount + 1, the SVs of class i are [starts[i], starts[i + 1])
+  size_t *pairOffsets = nullptr;  // pairCount, first coefficient of each pair
+
+  double kernel(double dot, double xSquare, double svSquare) const { return kernels::fromDot(kernelType, dot, xSquare + svSquare, gamma, coef0, degree); }
+
+  // Sums a cache line of products at a time into independent lanes, which the compiler can keep in vector registers.
+  // n must be a multiple of the values in a cache line, which the stride is.
+  static double dotProduct(const svm_value *a, const svm_value *b, size_t n) {
+    constexpr size_t lanes = cacheLineSize / sizeof(svm_value);
+    double sums[lanes] = {};
+    for (size_t d = 0; d < n; d += lanes) {
+      for (size_t k = 0; k < lanes; k++) sums[k] += static_cast<double>(a[d + k]) * b[d + k];
+    }
+    double sum = 0;
+    for (size_t k = 0; k < lanes; k++) sum += sums[k];
+    return sum;
+  }
+
+  size_t pairIndex(size_t i, size_t j) const { return i * (2 * classCount - i - 1) / 2 + (j - i - 1); }
+
+  // Decision value of the classifier of classes i < j, positive when it votes for i.
+  double pairDecision(size_t i, size_t j, const double *kvalues) const {
+    const size_t p = pairIndex(i, j);
+    const double *coefficient = coefficients + pairOffsets[p];
+    double sum = 0;
+    for (int k = starts[i]; k < starts[i + 1]; k++) sum += *coefficient++ * kvalues[k];
+    for (int k = starts[j]; k < starts[j + 1]; k++) sum += *coefficient++ * kvalues[k];
+    return sum - rhos[p];
+  }
+
+ public:
+  // Per-thread scratch space of predict(), sized for one model.
+  class Workspace {
+    friend class CompiledModel;
+    AlignedArray<svm_value> x;
+    double xSquare = 0;
+    std::vector<double> kvalues;
+    std::vector<char> ready;
+    std::vector<int> votes;
+    std::vector<int> losses;
+    std::vector<char> played; // classCount x classCount
+
+   public:
+    explicit Workspace(const CompiledModel &model)
+        : x(makeAlignedArray<svm_value>(model.stride)), kvalues(model.svCount), ready(model.classCount), votes(model.classCount), losses(model.classCount),
+          played(model.classCount * model.classCount) {}
+  };
+
+ private:
+  // Computes the kernel values of the SVs of class c unless they already were for this input.
+  void computeClassKernels(size_t c, Workspace &workspace) const {
+    if (workspace.ready[c]) return;
+    const svm_value *dense = workspace.x.get();
+    for (int i = starts[c]; i < starts[c + 1]; i++) {
+      workspace.kvalues[i] = kernel(dotProduct(dense, svs + i * stride, stride), workspace.xSquare, svSquares[i]);
+    }
+    workspace.ready[c] = 1;
+  }
+
+  size_t decideMaxWins(Workspace &workspace) const {
+    for (size_t c = 0; c < classCount; c++) computeClassKernels(c, workspace);
+    int *votes = workspace.votes.data();
+    for (size_t i = 0; i < classCount; i++) {
+      for (size_t j = i + 1; j < classCount; j++) {
+        if (pairDecision(i, j, workspace.kvalues.data()) > 0) {
+          votes[i]++;
+        } else {
+          votes[j]++;
+        }
+      }
+    }
+    size_t best = 0;
+    for (size_t i = 1; i < classCount; i++) {
+      if (votes[i] > votes[best]) best = i;
+    }
+    return best;
+  }
+
+  // Plays the pairs leader first and stops once a class has more votes than any other can still reach, see svm_predict_mode.
+  size_t decideEarlyExit(Workspace &workspace) const {
+    int *votes = workspace.votes.data();
+    int *losses = workspace.losses.data();
+    const auto ranksAbove = [&](size_t a, size_t b) { return votes[a] > votes[b] || (votes[a] == votes[b] && losses[a] < losses[b]); };
+    const int opponents = static_cast<int>(classCount) - 1;
+    size_t best = 0;
+    for (size_t round = 0; round < classCount * (classCount - 1) / 2; round++) {
+      size_t leader = classCount;
+      for (size_t c = 0; c < classCount; c++) {
+        if (votes[c] + losses[c] < opponents && (leader == classCount || ranksAbove(c, leader))) leader = c;
+      }
+      size_t opponent = classCount;
+      for (size_t c = 0; c < classCount; c++) {
+        if (c != leader && !workspace.played[leader * classCount + c] && (opponent == classCount || ranksAbove(c, opponent))) opponent = c;
+      }
+      const size_t i = std::min(leader, opponent);
+      const size_t j = std::max(leader, opponent);
+      computeClassKernels(i, workspace);
+      computeClassKernels(j, workspace);
+      workspace.played[i * classCount + j] = workspace.played[j * classCount + i] = 1;
+      if (pairDecision(i, j, workspace.kvalues.data()) > 0) {
+        votes[i]++;
+        losses[j]++;
+      } else {
+        votes[j]++;
+        losses[i]++;
+      }
+      best = 0;
+      for (size_t c = 1; c < classCount; c++) {
+        if (votes[c] > votes[best]) best = c;
+      }
+      bool decided = true;
+      for (size_t c = 0; c < classCount && decided; c++) {
+        if (c != best && opponents - losses[c] >= votes[best]) decided = false;
+      }
+      if (decided) break;
+    }
+    return best;
+  }
+
+  // Keeps the candidates first to last and drops the loser of the first against the last until one is left.
+  size_t decideDag(Workspace &workspace) const {
+    size_t first = 0;
+    size_t last = classCount - 1;
+    while (first < last) {
+      computeClassKernels(first, workspace);
+      computeClassKernels(last, workspace);
+      if (pairDecision(first, last, workspace.kvalues.data()) > 0) {
+        last--;
+      } else {
+        first++;
+      }
+    }
+    return first;
+  }
+
+ public:
+  explicit CompiledModel(const svm_model &model, int decisionMode = MAX_WINS)
+      : decisionMode(decisionMode), kernelType(model.param.kernel_type), degree(model.param.degree), gamma(model.param.gamma), coef0(model.param.coef0), classCount(model.nr_class), svCount(model.l) {
+    if (model.param.svm_type != C_SVC && model.param.svm_type != NU_SVC) throw std::invalid_argument("Only classification models can be compiled.");
+    if (kernelType == PRECOMPUTED) throw std::invalid_argument("Models with precomputed kernels cannot be compiled.");
+    dimension = 0;
+    for (size_t i = 0; i < svCount; i++) {
+      for (const svm_node *node = model.SV[i]; node->index != -1; node++) dimension = std::max(dimension, static_cast<size_t>(node->index));
+    }
+    stride = roundUpToCacheLine(dimension * sizeof(svm_value)) / sizeof(svm_value);
+    const size_t pairCount = classCount * (classCount - 1) / 2;
+    size_t coefficientCount = 0;
+    for (size_t i = 0; i < classCount; i++) coefficientCount += model.nSV[i] * (classCount - 1);
+    const size_t svsBytes = roundUpToCacheLine(svCount * stride * sizeof(svm_value));
+    const size_t svSquaresBytes = roundUpToCacheLine(svCount * sizeof(double));
+    const size_t coefficientsBytes = roundUpToCacheLine(coefficientCount * sizeof(double));
+    const size_t rhosBytes = roundUpToCacheLine(pairCount * sizeof(double));
+    const size_t labelsBytes = roundUpToCacheLine(classCount * sizeof(int));
+    const size_t startsBytes = roundUpToCacheLine((classCount + 1) * sizeof(int));
+    const size_t pairOffsetsBytes = roundUpToCacheLine(pairCount * sizeof(size_t));
+    blockSize = svsBytes + svSquaresBytes + coefficientsBytes + rhosBytes + labelsBytes + startsBytes + pairOffsetsBytes;
+    block = makeAlignedArray<unsigned char>(blockSize);
+    unsigned char *section = block.get();
+    svs = reinterpret_cast<svm_value *>(section);
+    svSquares = reinterpret_cast<double *>(section += svsBytes);
+    coefficients = reinterpret_cast<double *>(section += svSquaresBytes);
+    rhos = reinterpret_cast<double *>(section += coefficientsBytes);
+    labels = reinterpret_cast<int *>(section += rhosBytes);
+    starts = reinterpret_cast<int *>(section += labelsBytes);
+    pairOffsets = reinterpret_cast<size_t *>(section += startsBytes);
+
+    for (size_t i = 0; i < svCount; i++) {
+      svm_value *row = svs + i * stride;
+      for (const svm_node *node = model.SV[i]; node->index != -1; node++) {
+        if (node->index >= 1) row[node->index - 1] = node->value;
+      }
+      double square = 0;
+      for (size_t d = 0; d < dimension; d++) square += static_cast<double>(row[d]) * row[d];
+      svSquares[i] = square;
+    }
+    starts[0] = 0;
+    for (size_t i = 0; i < classCount; i++) {
+      labels[i] = model.label[i];
+      starts[i + 1] = starts[i] + model.nSV[i];
+    }
+    // Classifier (i, j) has the coefficients of the SVs of class i in sv_coef[j - 1] and the ones of class j in sv_coef[i].
+    size_t p = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < classCount; i++) {
+      for (size_t j = i + 1; j < classCount; j++) {
+        pairOffsets[p] = offset;
+        rhos[p] = model.rho[p];
+        for (int k = starts[i]; k < starts[i + 1]; k++) coefficients[offset++] = model.sv_coef[j - 1][k];
+        for (int k = starts[j]; k < starts[j + 1]; k++) coefficients[offset++] = model.sv_coef[i][k];
+        p++;
+      }
+    }
+  }
+
+  size_t getDimension() const { return dimension; }
+
+  size_t getSizeInBytes() const { return blockSize; }
+
+  double predict(const svm_node *x, Workspace &workspace) const {
+    svm_value *dense = workspace.x.get();
+    std::fill(dense, dense + stride, svm_value{0});
+    for (const svm_node *node = x; node->index != -1; node++) {
+      if (node->index >= 1 && static_cast<size_t>(node->index) <= dimension) dense[node->index - 1] = node->value;
+    }
+    workspace.xSquare = 0;
+    for (const svm_node *node = x; node->index != -1; node++) workspace.xSquare += static_cast<double>(node->value) * node->value;
+    std::fill(workspace.ready.begin(), workspace.ready.end(), 0);
+    std::fill(workspace.votes.begin(), workspace.votes.end(), 0);
+    std::fill(workspace.losses.begin(), workspace.losses.end(), 0);
+    std::fill(workspace.played.begin(), workspace.played.end(), 0);
+    switch (decisionMode) {
+      case EARLY_EXIT:
+        return labels[decideEarlyExit(workspace)];
+      case DAG:
+        return labels[decideDag(workspace)];
+      default:
+        return labels[decideMaxWins(workspace)];
+    }
+  }
+};
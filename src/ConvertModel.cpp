@@ -0,0 +1,35 @@
+#include <iostream>
+#include <string>
+
+#include "ModelExport.hpp"
+#include "ModelFile.hpp"
+#include "Timer.hpp"
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cout << "Usage: " << argv[0] << " [INPUT MODEL] [OUTPUT MODEL]" << '\n';
+    std::cout << "Models are read in either format and written in the binary format if the output name ends in .bin." << '\n';
+    std::cout << "Classification models are written as C++ headers for EmbeddedPredictor if the output name ends in .hpp." << '\n';
+    return 1;
+  }
+  const std::string input = argv[1];
+  const std::string output = argv[2];
+  Timer timer;
+  std::cout << "Loading model...";
+  std::cout.flush();
+  timer.start();
+  const auto model = loadModel(input);
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+  std::cout << "Saving model...";
+  std::cout.flush();
+  timer.restart();
+  if (isModelHeaderFile(output)) {
+    exportModelHeader(output, *model);
+  } else {
+    saveModel(output, model.get());
+  }
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+  return 0;
+}
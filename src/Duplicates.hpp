@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "SVM.h"
+#include "Types.hpp"
+
+// Collapses the rows with the same label and features into their first one, which gets the number of rows as its weight.
+// A row of weight w in C-SVC is the same as w copies of it, but the solver works on l rows and its cost grows with l squared.
+// Returns the weights of the rows left at the front of xs and ys. A model trained on them has SVs that are collapsed rows, so its SV indices
+// refer to the rows left rather than to the original ones.
+inline std::vector<double> collapseDuplicates(std::vector<std::vector<svm_node>> &xs, std::vector<double> &ys) {
+  std::unordered_map<U64, std::vector<size_t>> rowsByHash;
+  std::vector<double> weights;
+  for (size_t i = 0; i < xs.size(); i++) {
+    auto &candidates = rowsByHash[svm_hash_row(xs[i].data())];
+    const auto same = std::find_if(candidates.begin(), candidates.end(), [&](size_t j) { return ys[j] == ys[i] && svm_same_row(xs[j].data(), xs[i].data()); });
+    if (same != candidates.end()) {
+      weights[*same]++;
+      continue;
+    }
+    const size_t j = weights.size();
+    if (j != i) {
+      xs[j] = std::move(xs[i]);
+      ys[j] = ys[i];
+    }
+    candidates.push_back(j);
+    weights.push_back(1);
+  }
+  xs.resize(weights.size());
+  ys.resize(weights.size());
+  return weights;
+}
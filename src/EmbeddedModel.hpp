@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include "KernelFunction.hpp"
+
+// The kernel types of svm_parameter that can be exported.
+enum class EmbeddedKernel { Linear = LINEAR, Polynomial = POLY, Rbf = RBF, Sigmoid = SIGMOID };
+
+// Predicts with a model compiled into the program, as exported by convert-model into a header.
+//
+// Model is the struct of that header. Its kernel, class count and dimension are constants and its arrays are constexpr, so every loop below
+// has known bounds and reads known data, which lets the compiler unroll and fold them, and nothing is loaded or parsed at startup.
+// A linear model is exported as one weight vector per class pair; other kernels as their SVs, with the squared norms of the SVs and the
+// coefficients laid out like svm_model::sv_coef. Classes are decided by max-wins voting, like svm_predict.
+template <typename Model>
+class EmbeddedPredictor {
+  static constexpr std::size_t classCount = Model::classCount;
+  static constexpr std::size_t dimension = Model::dimension;
+
+  static double dot(const double (&a)[dimension], const double (&b)[dimension]) {
+    double sum = 0;
+    for (std::size_t d = 0; d < dimension; d++) sum += a[d] * b[d];
+    return sum;
+  }
+
+ public:
+  // The values of features 1 to dimension; features beyond those have no SV and do not affect the prediction.
+  using Input = double[dimension];
+
+  static int predict(const Input &x) {
+    std::array<int, classCount> votes{};
+    if constexpr (Model::kernel == EmbeddedKernel::Linear) {
+      std::size_t p = 0;
+      for (std::size_t i = 0; i < classCount; i++) {
+        for (std::size_t j = i + 1; j < classCount; j++) {
+          if (dot(Model::weights[p], x) - Model::rhos[p] > 0) {
+            votes[i]++;
+          } else {
+            votes[j]++;
+          }
+          p++;
+        }
+      }
+    } else {
+      const double xSquare = dot(x, x);
+      std::array<double, Model::svCount> kvalues;
+      for (std::size_t s = 0; s < Model::svCount; s++) {
+        kvalues[s] = kernels::fromDot<static_cast<int>(Model::kernel)>(dot(Model::svs[s], x), xSquare + Model::svSquares[s], Model::gamma, Model::coef0, Model::degree);
+      }
+      std::size_t p = 0;
+      for (std::size_t i = 0; i < classCount; i++) {
+        for (std::size_t j = i + 1; j < classCount; j++) {
+          double sum = 0;
+          for (std::size_t k = Model::starts[i]; k < Model::starts[i + 1]; k++) sum += Model::coefficients[j - 1][k] * kvalues[k];
+          for (std::size_t k = Model::starts[j]; k < Model::starts[j + 1]; k++) sum += Model::coefficients[i][k] * kvalues[k];
+          if (sum - Model::rhos[p] > 0) {
+            votes[i]++;
+          } else {
+            votes[j]++;
+          }
+          p++;
+        }
+      }
+    }
+    std::size_t best = 0;
+    for (std::size_t i = 1; i < classCount; i++) {
+      if (votes[i] > votes[best]) best = i;
+    }
+    return Model::labels[best];
+  }
+
+  // Predicts a sparse row of nodes with index and value members ending in index -1, such as svm_node.
+  template <typename Node>
+  static int predict(const Node *x) {
+    double dense[dimension] = {};
+    for (const Node *node = x; node->index != -1; node++) {
+      if (node->index >= 1 && static_cast<std::size_t>(node->index) <= dimension) dense[node->index - 1] = node->value;
+    }
+    return predict(dense);
+  }
+};
@@ -0,0 +1,14 @@
+// Compiles EmbeddedPredictor against the headers convert-model exports for the small models in models/, so that both the exporter and
+// the predictor are checked by every build.
+#include "EmbeddedModel.hpp"
+#include "tinyLinear.hpp"
+#include "tinyRbf.hpp"
+
+static_assert(tinyLinearModel::kernel == EmbeddedKernel::Linear && tinyLinearModel::classCount == 3);
+static_assert(tinyRbfModel::kernel == EmbeddedKernel::Rbf && tinyRbfModel::classCount == 3 && tinyRbfModel::svCount == 24);
+
+int predictWithTinyModels(const double (&x)[tinyRbfModel::dimension]) {
+  double linearX[tinyLinearModel::dimension] = {};
+  for (std::size_t d = 0; d < tinyLinearModel::dimension && d < tinyRbfModel::dimension; d++) linearX[d] = x[d];
+  return EmbeddedPredictor<tinyLinearModel>::predict(linearX) + EmbeddedPredictor<tinyRbfModel>::predict(x);
+}
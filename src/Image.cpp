@@ -0,0 +1 @@
+#include "Image.hpp"
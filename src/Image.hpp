@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "SVM.h"
+
+constexpr size_t imageSide = 28;
+constexpr size_t imageSize = imageSide * imageSide;
+constexpr size_t threshold = 1;
+
+using Label = uint8_t;
+
+class Image {
+ public:
+  std::array<uint8_t, imageSize> data{};
+  void applyThreshold() {
+    for (auto &pixel : data) {
+      if (pixel < threshold) {
+        pixel = 0;
+      } else {
+        pixel = 1;
+      }
+    }
+  }
+  uint8_t operator[](size_t i) const { return data[i]; }
+  uint8_t &operator[](size_t i) { return data[i]; }
+};
+
+class LabeledImage {
+ public:
+  std::optional<Label> label;
+  Image image;
+
+  LabeledImage(std::optional<Label> label, const Image &image) : label(label), image(image) {}
+};
+
+inline std::vector<svm_node> simpleNodesFromImage(const Image &image) {
+  std::vector<svm_node> nodes;
+  for (size_t i = 0; i < imageSize; i++) {
+    if (image[i] != 0) {
+      nodes.push_back(svm_node{});
+      nodes.back().index = static_cast<int>(i + 1);
+      nodes.back().value = image[i];
+    }
+  }
+  nodes.push_back(svm_node{});
+  nodes.back().index = -1;
+  nodes.back().value = 0;
+  return nodes;
+}
+
+inline std::vector<svm_node> edgeCountersFromImage(const Image &image) {
+  std::vector<size_t> edges(2 * imageSide);
+  for (size_t i = 1; i < imageSide; i++) {
+    for (size_t j = 1; j < imageSide; j++) {
+      if (image[i * imageSide + j] != image[(i - 1) * imageSide + j]) edges[i]++;
+      if (image[i * imageSide + j] != image[i * imageSide + (j - 1)]) edges[imageSide + j]++;
+    }
+  }
+  std::vector<svm_node> nodes;
+  for (size_t i = 0; i < 2 * imageSide; i++) {
+    if (edges[i] != 0) {
+      nodes.push_back(svm_node{});
+      nodes.back().index = static_cast<int>(i + 1);
+      nodes.back().value = edges[i];
+    }
+  }
+  nodes.push_back(svm_node{});
+  nodes.back().index = -1;
+  nodes.back().value = 0;
+  return nodes;
+}
+
+// Reads the images of a CSV file with a header line a batch at a time, so memory does not depend on the size of the file.
+// Each line has the label, if labeled, followed by the imageSize pixels.
+class ImageReader {
+  std::ifstream ifs;
+  bool labeled;
+  size_t imageCount = 0;
+
+ public:
+  ImageReader(const std::string &filename, bool labeled) : ifs(filename), labeled(labeled) {
+    if (!ifs) throw std::runtime_error("Could not open " + filename + ".");
+    ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+
+  // Replaces the contents of batch with the next batchSize images or as many as are left, returning false if there were none.
+  // Throws if a line is cut short or has something else than pixel values.
+  bool read(std::vector<LabeledImage> &batch, size_t batchSize) {
+    batch.clear();
+    uint16_t value;
+    while (batch.size() < batchSize && ifs >> value) {
+      std::optional<Label> optionalLabel;
+      if (labeled) optionalLabel = static_cast<Label>(value);
+      Image image;
+      if (!labeled && value > 255) throw std::runtime_error("Malformed image after " + std::to_string(imageCount) + " images.");
+      if (!labeled) image[0] = static_cast<uint8_t>(value);
+      for (size_t j = labeled ? 0 : 1; j < imageSize; j++) {
+        char comma;
+        ifs >> comma >> value;
+        if (!ifs || comma != ',' || value > 255) throw std::runtime_error("Malformed image after " + std::to_string(imageCount) + " images.");
+        image[j] = static_cast<uint8_t>(value);
+      }
+      imageCount++;
+      batch.emplace_back(optionalLabel, image);
+    }
+    return !batch.empty();
+  }
+};
+
+inline std::vector<LabeledImage> readImagesFromFile(const std::string &filename, bool labeled) {
+  std::vector<LabeledImage> labeledImages;
+  ImageReader reader(filename, labeled);
+  reader.read(labeledImages, std::numeric_limits<size_t>::max());
+  return labeledImages;
+}
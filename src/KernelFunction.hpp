@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cmath>
+
+#include "SVM.h"
+
+// The kernels of svm_parameter computed from the dot product of two vectors, shared by libsvm and the inference layouts built on its
+// models, so that every path computes the same kernel values the same way.
+namespace kernels {
+// base to the power of times, by squaring.
+inline double powi(double base, int times) {
+  double result = 1.0;
+  for (int t = times; t > 0; t /= 2) {
+    if (t % 2 == 1) result *= base;
+    base *= base;
+  }
+  return result;
+}
+
+// The kernel of two vectors from their dot product and, for RBF, the sum of their squared norms.
+// KernelType is LINEAR, POLY, RBF or SIGMOID; as a template argument it lets a loop over many vectors be compiled for one kernel.
+template <int KernelType>
+inline double fromDot(double dot, double squares, double gamma, double coef0, int degree) {
+  if constexpr (KernelType == POLY) {
+    return powi(gamma * dot + coef0, degree);
+  } else if constexpr (KernelType == RBF) {
+    return std::exp(-gamma * (squares - 2 * dot));
+  } else if constexpr (KernelType == SIGMOID) {
+    return std::tanh(gamma * dot + coef0);
+  } else {
+    return dot;
+  }
+}
+
+inline double fromDot(int kernelType, double dot, double squares, double gamma, double coef0, int degree) {
+  switch (kernelType) {
+    case POLY:
+      return fromDot<POLY>(dot, squares, gamma, coef0, degree);
+    case RBF:
+      return fromDot<RBF>(dot, squares, gamma, coef0, degree);
+    case SIGMOID:
+      return fromDot<SIGMOID>(dot, squares, gamma, coef0, degree);
+    default:
+      return dot;
+  }
+}
+} // namespace kernels
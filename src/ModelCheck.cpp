@@ -0,0 +1,486 @@
+// Checks the prediction paths and the model transformations against each other on the small models in models/.
+// model-check [CHECK] [MODELS DIRECTORY]
+// Every check is a CTest test, see CMakeLists.txt. Files a check writes go to the working directory.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "SVM.h"
+
+#include "CompiledModel.hpp"
+#include "Duplicates.hpp"
+#include "ModelFile.hpp"
+#include "ModelHolder.hpp"
+#include "Predictor.hpp"
+#include "QuantizedModel.hpp"
+#include "Types.hpp"
+
+namespace {
+
+void check(bool condition, const std::string &message) {
+  if (!condition) throw std::runtime_error(message);
+}
+
+// A deterministic generator, so a failure can be reproduced.
+class Lcg {
+  U64 state;
+
+ public:
+  explicit Lcg(U64 seed) : state(seed) {}
+  U32 next(U32 bound) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<U32>((state >> 33) % bound);
+  }
+};
+
+std::vector<svm_node> rowOf(const std::vector<double> &dense) {
+  std::vector<svm_node> row;
+  for (size_t d = 0; d < dense.size(); d++) {
+    if (dense[d] != 0) row.push_back(svm_node{static_cast<int>(d + 1), static_cast<svm_value>(dense[d])});
+  }
+  row.push_back(svm_node{-1, 0});
+  return row;
+}
+
+std::vector<double> denseOf(const svm_node *x) {
+  std::vector<double> dense;
+  for (; x->index != -1; x++) {
+    dense.resize(std::max<size_t>(dense.size(), x->index));
+    dense[x->index - 1] = x->value;
+  }
+  return dense;
+}
+
+// Inputs like the images the models were trained on, every SV and copies of them with some counters changed, and as many rows of
+// random counters, on which the pair classifiers sometimes vote in a cycle and the decision modes disagree.
+std::vector<std::vector<svm_node>> makeInputs(const svm_model &model, size_t copiesPerSv) {
+  std::vector<std::vector<svm_node>> inputs;
+  Lcg lcg(model.l);
+  size_t dimension = 0;
+  for (int i = 0; i < model.l; i++) {
+    const std::vector<double> dense = denseOf(model.SV[i]);
+    dimension = std::max(dimension, dense.size());
+    inputs.push_back(rowOf(dense));
+    for (size_t c = 0; c < copiesPerSv; c++) {
+      std::vector<double> copy = dense;
+      for (auto &value : copy) {
+        if (lcg.next(3) == 0) value = std::max(0.0, value + static_cast<double>(lcg.next(7)) - 3);
+      }
+      inputs.push_back(rowOf(copy));
+    }
+  }
+  for (size_t r = inputs.size(), count = 2 * r; r < count; r++) {
+    std::vector<double> random(dimension);
+    for (auto &value : random) value = lcg.next(4) == 0 ? lcg.next(16) : 0;
+    inputs.push_back(rowOf(random));
+  }
+  return inputs;
+}
+
+ModelPointer loadTinyModel(const std::string &directory, const std::string &name) { return loadModel(directory + "/" + name + ".model"); }
+
+const char *const tinyModels[] = {"tinyLinear", "tinyRbf"};
+
+// Early exit stops voting once no class can catch up with the leader, which must not change the class max-wins picks.
+void checkEarlyExit(const std::string &directory) {
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    Predictor predictor(model.get(), EARLY_EXIT);
+    for (const auto &x : makeInputs(*model, 20)) {
+      const double maxWins = svm_predict(model.get(), x.data());
+      check(svm_predict_mode(model.get(), x.data(), EARLY_EXIT) == maxWins, std::string("svm_predict_mode with EARLY_EXIT differs from max-wins for ") + name + ".");
+      check(predictor.predict(x.data()) == maxWins, std::string("Predictor with EARLY_EXIT differs from max-wins for ") + name + ".");
+    }
+  }
+}
+
+// The class DAG-SVM picks from the decision values of all pairs: the first and the last candidate play, the loser is dropped.
+double dagFromDecisionValues(const svm_model &model, const std::vector<double> &decisionValues) {
+  const int k = model.nr_class;
+  int first = 0;
+  int last = k - 1;
+  while (first < last) {
+    if (decisionValues[first * (2 * k - first - 1) / 2 + (last - first - 1)] > 0) {
+      last--;
+    } else {
+      first++;
+    }
+  }
+  return model.label[first];
+}
+
+void checkDag(const std::string &directory) {
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    Predictor predictor(model.get(), DAG);
+    std::vector<double> decisionValues(model->nr_class * (model->nr_class - 1) / 2);
+    size_t disagreements = 0;
+    for (const auto &x : makeInputs(*model, 20)) {
+      const double maxWins = svm_predict_values(model.get(), x.data(), decisionValues.data());
+      const double dag = dagFromDecisionValues(*model, decisionValues);
+      check(svm_predict_mode(model.get(), x.data(), DAG) == dag, std::string("svm_predict_mode with DAG differs from the DAG of the decision values for ") + name + ".");
+      check(predictor.predict(x.data()) == dag, std::string("Predictor with DAG differs from the DAG of the decision values for ") + name + ".");
+      disagreements += dag != maxWins;
+    }
+    std::cout << name << ": DAG and max-wins disagree on " << disagreements << " inputs." << '\n';
+  }
+}
+
+bool nearlyEqual(double a, double b) { return std::fabs(a - b) <= 1e-9 * (1 + std::fabs(a)); }
+
+// Compares svm_predict_batch with svm_predict_values one input at a time, for a batch of all the inputs and batches of one.
+void checkBatchOf(const svm_model &model, const std::vector<std::vector<svm_node>> &inputs, const std::string &name) {
+  const size_t pairCount = model.nr_class * (model.nr_class - 1) / 2;
+  std::vector<const svm_node *> xs;
+  for (const auto &x : inputs) xs.push_back(x.data());
+  std::vector<double> predictions(xs.size());
+  std::vector<double> batchDecisionValues(xs.size() * pairCount);
+  svm_predict_batch(&model, xs.data(), static_cast<int>(xs.size()), predictions.data(), batchDecisionValues.data());
+  std::vector<double> decisionValues(pairCount);
+  for (size_t i = 0; i < xs.size(); i++) {
+    const double prediction = svm_predict_values(&model, xs[i], decisionValues.data());
+    check(predictions[i] == prediction, "svm_predict_batch predicts another class than svm_predict_values for " + name + ".");
+    for (size_t p = 0; p < pairCount; p++) check(nearlyEqual(batchDecisionValues[i * pairCount + p], decisionValues[p]), "svm_predict_batch has other decision values for " + name + ".");
+    double single = 0;
+    svm_predict_batch(&model, &xs[i], 1, &single, batchDecisionValues.data());
+    check(single == prediction, "svm_predict_batch of one input predicts another class than svm_predict_values for " + name + ".");
+  }
+}
+
+// The batch path looks the columns of the features the SVs use up in a table, or by binary search when the indices are too sparse
+// for one, so the models are also checked with their indices spread far apart.
+void checkBatch(const std::string &directory) {
+  constexpr int spread = 1000003;
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    auto inputs = makeInputs(*model, 20);
+    checkBatchOf(*model, inputs, name);
+    for (int i = 0; i < model->l; i++) {
+      for (svm_node *node = model->SV[i]; node->index != -1; node++) node->index *= spread;
+    }
+    for (auto &x : inputs) {
+      for (auto &node : x) {
+        if (node.index != -1) node.index *= spread;
+      }
+    }
+    checkBatchOf(*model, inputs, std::string("sparse ") + name);
+  }
+}
+
+void checkCompiledModel(const std::string &directory) {
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    const auto inputs = makeInputs(*model, 20);
+    for (const int mode : {MAX_WINS, EARLY_EXIT, DAG}) {
+      const CompiledModel compiledModel(*model, mode);
+      CompiledModel::Workspace workspace(compiledModel);
+      for (const auto &x : inputs) {
+        check(compiledModel.predict(x.data(), workspace) == svm_predict_mode(model.get(), x.data(), mode),
+              "CompiledModel predicts another class than svm_predict_mode in mode " + std::to_string(mode) + " for " + name + ".");
+      }
+    }
+  }
+}
+
+// The integer dot products of every implementation the CPU supports must be exactly the ones of the plain C++ version, and the classes of
+// the quantized models must mostly be the ones of svm_predict: quantizing the weights changes a few close decisions, not more.
+void checkQuantizedModel(const std::string &directory) {
+  constexpr size_t count = 16;
+  constexpr size_t stride = 256;
+  const auto input = makeAlignedArray<uint8_t>(stride);
+  const auto rows = makeAlignedArray<int8_t>(count * stride);
+  Lcg lcg(stride);
+  for (size_t d = 0; d < stride; d++) input[d] = static_cast<uint8_t>(lcg.next(quantized::maximumLevel + 1));
+  for (size_t i = 0; i < count * stride; i++) rows[i] = static_cast<int8_t>(static_cast<int>(lcg.next(2 * quantized::maximumLevel + 1)) - quantized::maximumLevel);
+  std::vector<quantized::DotsImplementation> implementations{quantized::selectDots()};
+#ifdef QUANTIZED_MODEL_X86
+  if (__builtin_cpu_supports("avx2")) implementations.push_back({quantized::dotsAvx2, "AVX2"});
+#endif
+  std::vector<int32_t> expected(count);
+  quantized::dotsScalar(input.get(), rows.get(), count, stride, expected.data());
+  for (const auto &implementation : implementations) {
+    std::vector<int32_t> actual(count);
+    implementation.function(input.get(), rows.get(), count, stride, actual.data());
+    check(actual == expected, std::string("The ") + implementation.name + " dot products differ from the scalar ones.");
+  }
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    const QuantizedModel quantizedModel(*model);
+    QuantizedModel::Workspace workspace(quantizedModel);
+    const auto inputs = makeInputs(*model, 20);
+    size_t same = 0;
+    for (const auto &x : inputs) same += quantizedModel.predict(x.data(), workspace) == svm_predict(model.get(), x.data());
+    std::cout << name << ": the quantized model predicts the class of svm_predict for " << same << " of " << inputs.size() << " inputs." << '\n';
+    check(same >= 0.98 * inputs.size(), std::string("The quantized model predicts too many other classes than svm_predict for ") + name + ".");
+  }
+}
+
+void checkSameModel(const svm_model &expected, const svm_model &actual, const std::string &name) {
+  const auto same = [&](bool condition, const std::string &what) { check(condition, name + " has another " + what + " than the model saved."); };
+  same(actual.param.svm_type == expected.param.svm_type && actual.param.kernel_type == expected.param.kernel_type, "type");
+  same(actual.param.degree == expected.param.degree && actual.param.gamma == expected.param.gamma && actual.param.coef0 == expected.param.coef0, "kernel");
+  same(actual.nr_class == expected.nr_class && actual.l == expected.l, "size");
+  const int pairCount = expected.nr_class * (expected.nr_class - 1) / 2;
+  same(std::equal(expected.rho, expected.rho + pairCount, actual.rho), "rho");
+  same(std::equal(expected.label, expected.label + expected.nr_class, actual.label), "label");
+  same(std::equal(expected.nSV, expected.nSV + expected.nr_class, actual.nSV), "nSV");
+  same((expected.probA == nullptr) == (actual.probA == nullptr) && (expected.probB == nullptr) == (actual.probB == nullptr), "probability");
+  for (int k = 0; k < expected.nr_class - 1; k++) same(std::equal(expected.sv_coef[k], expected.sv_coef[k] + expected.l, actual.sv_coef[k]), "sv_coef");
+  for (int i = 0; i < expected.l; i++) same(svm_same_row(expected.SV[i], actual.SV[i]) != 0, "SV");
+}
+
+std::string readFile(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string &filename, const std::string &contents) {
+  std::ofstream file(filename, std::ios::binary);
+  file << contents;
+  check(static_cast<bool>(file), "Could not write " + filename + ".");
+}
+
+// Saves the models in the binary format, maps them back and compares them, and checks that a file cut short or holding an inconsistent
+// model is rejected.
+void checkBinaryFormat(const std::string &directory) {
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    const std::string filename = std::string(name) + ".bin";
+    saveModel(filename, model.get());
+    const ModelPointer mapped(svm_load_model_mmap(filename.c_str()));
+    check(mapped != nullptr && mapped->mapping != nullptr, "The binary " + filename + " was not mapped.");
+    checkSameModel(*model, *mapped, "The binary " + filename);
+    for (const auto &x : makeInputs(*model, 5)) check(svm_predict(mapped.get(), x.data()) == svm_predict(model.get(), x.data()), "The binary " + filename + " predicts other classes.");
+
+    const std::string contents = readFile(filename);
+    writeFile("damaged.bin", contents.substr(0, contents.size() - 1));
+    check(ModelPointer(svm_load_model_mmap("damaged.bin")) == nullptr, "The binary " + filename + " cut short was loaded.");
+    model->nSV[0]++;
+    saveModel("damaged.bin", model.get());
+    model->nSV[0]--;
+    check(ModelPointer(svm_load_model_mmap("damaged.bin")) == nullptr, "The binary " + filename + " with SV counts not adding up was loaded.");
+    model->param.svm_type = NU_SVR + 1;
+    saveModel("damaged.bin", model.get());
+    model->param.svm_type = C_SVC;
+    check(ModelPointer(svm_load_model_mmap("damaged.bin")) == nullptr, "The binary " + filename + " with an unknown SVM type was loaded.");
+  }
+}
+
+// Saves the models in the text format, loads them back and compares them, and checks that saving the loaded model writes the same file
+// and that the SV lines may have signs on their positive numbers.
+void checkTextFormat(const std::string &directory) {
+  for (const char *name : tinyModels) {
+    const auto model = loadTinyModel(directory, name);
+    const std::string filename = std::string(name) + ".model";
+    saveModel(filename, model.get());
+    const auto loaded = loadModel(filename);
+    checkSameModel(*model, *loaded, "The text " + filename);
+    saveModel("saved-again.model", loaded.get());
+    const std::string contents = readFile(filename);
+    check(readFile("saved-again.model") == contents, "Saving the loaded " + filename + " writes another file.");
+
+    std::string withSigns;
+    const size_t svs = contents.find("SV\n") + 3;
+    for (size_t i = 0; i < contents.size(); i++) {
+      const bool startsNumber = i >= svs && (contents[i - 1] == '\n' || contents[i - 1] == ' ' || contents[i - 1] == ':');
+      if (startsNumber && contents[i] >= '0' && contents[i] <= '9') withSigns += '+';
+      withSigns += contents[i];
+    }
+    writeFile("signed.model", withSigns);
+    checkSameModel(*model, *loadModel("signed.model"), "The text " + filename + " with signs");
+  }
+}
+
+// The problem of xs and ys, which must outlive it, with pointers holding the rows.
+svm_problem problemOf(std::vector<std::vector<svm_node>> &xs, std::vector<double> &ys, std::vector<svm_node *> &pointers) {
+  pointers.clear();
+  for (auto &x : xs) pointers.push_back(x.data());
+  svm_problem problem{};
+  problem.l = static_cast<int>(xs.size());
+  problem.y = ys.data();
+  problem.x = pointers.data();
+  return problem;
+}
+
+// Training parameters with the kernel of model.
+svm_parameter trainingParameterOf(const svm_model &model) {
+  svm_parameter parameter{};
+  parameter.svm_type = C_SVC;
+  parameter.kernel_type = model.param.kernel_type;
+  parameter.degree = model.param.degree;
+  parameter.gamma = model.param.gamma;
+  parameter.coef0 = model.param.coef0;
+  parameter.cache_size = 16;
+  parameter.C = 1;
+  parameter.eps = 0.001;
+  return parameter;
+}
+
+// Decision values of all inputs, one row of pairs after another.
+std::vector<double> decisionValuesOf(const svm_model &model, const std::vector<std::vector<svm_node>> &inputs) {
+  const size_t pairCount = model.nr_class * (model.nr_class - 1) / 2;
+  std::vector<double> decisionValues(inputs.size() * pairCount);
+  for (size_t i = 0; i < inputs.size(); i++) svm_predict_values(&model, inputs[i].data(), decisionValues.data() + i * pairCount);
+  return decisionValues;
+}
+
+// Trains an RBF model on the inputs of tinyRbf labeled by it, each of them twice, so its SVs come in identical pairs.
+// Compacting without a tolerance must merge them and keep every decision value; with one, the SVs dropped have coefficients below it
+// and kernel values of at most 1, so no decision value may move by more than the tolerance times their count.
+void checkCompaction(const std::string &directory) {
+  const auto source = loadTinyModel(directory, "tinyRbf");
+  std::vector<std::vector<svm_node>> xs;
+  std::vector<double> ys;
+  for (const auto &x : makeInputs(*source, 5)) {
+    const double y = svm_predict(source.get(), x.data());
+    for (int copy = 0; copy < 2; copy++) {
+      xs.push_back(x);
+      ys.push_back(y);
+    }
+  }
+  std::vector<svm_node *> pointers;
+  const svm_problem problem = problemOf(xs, ys, pointers);
+  const svm_parameter parameter = trainingParameterOf(*source);
+  const ModelPointer model(svm_train(&problem, &parameter));
+  const auto inputs = makeInputs(*source, 20);
+  const auto decisionValues = decisionValuesOf(*model, inputs);
+
+  const ModelPointer merged(svm_compact_model(model.get(), 0));
+  std::cout << "Compacting merged " << model->l << " SVs into " << merged->l << "." << '\n';
+  check(merged->l < model->l, "Compacting merged no SVs of the model trained on duplicates.");
+  const auto mergedDecisionValues = decisionValuesOf(*merged, inputs);
+  for (size_t i = 0; i < decisionValues.size(); i++) check(nearlyEqual(mergedDecisionValues[i], decisionValues[i]), "Merging SVs changed a decision value.");
+
+  constexpr double tolerance = 0.05;
+  const ModelPointer pruned(svm_compact_model(model.get(), tolerance));
+  const int dropped = merged->l - pruned->l;
+  std::cout << "Compacting with a tolerance of " << tolerance << " dropped " << dropped << " more SVs." << '\n';
+  check(dropped > 0, "Compacting with a tolerance dropped no SVs.");
+  const auto prunedDecisionValues = decisionValuesOf(*pruned, inputs);
+  for (size_t i = 0; i < decisionValues.size(); i++) {
+    check(std::fabs(prunedDecisionValues[i] - decisionValues[i]) <= tolerance * dropped + 1e-9, "Dropping SVs changed a decision value by more than their coefficients allow.");
+  }
+}
+
+// Reader threads predict through snapshots while the models are published in turn, from text and binary files. Every prediction must
+// be the one of the model its snapshot holds, which the kernel type tells, and every retired model must be freed once the readers stop.
+void checkModelSwap(const std::string &directory) {
+  constexpr size_t readerCount = 4;
+  constexpr int publishCount = 200;
+  std::vector<ModelPointer> models;
+  for (const char *name : tinyModels) models.push_back(loadTinyModel(directory, name));
+  const auto inputs = makeInputs(*models[0], 2);
+  std::map<int, std::vector<double>> expected;
+  for (const auto &model : models) {
+    saveModel(std::string(model->param.kernel_type == LINEAR ? "linear" : "rbf") + ".bin", model.get());
+    for (const auto &x : inputs) expected[model->param.kernel_type].push_back(svm_predict(model.get(), x.data()));
+  }
+  ModelHolder holder(loadTinyModel(directory, tinyModels[0]));
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> mismatches{0};
+  std::atomic<size_t> predictions{0};
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < readerCount; r++) {
+    readers.emplace_back([&, r]() {
+      ModelHolder::Reader reader(holder);
+      for (size_t i = r; !stop; i = (i + 1) % inputs.size()) {
+        const auto snapshot = reader.snapshot();
+        if (svm_predict(snapshot.get(), inputs[i].data()) != expected.at(snapshot.get()->param.kernel_type)[i]) mismatches++;
+        predictions++;
+      }
+    });
+  }
+  for (int p = 0; p < publishCount; p++) {
+    const bool linear = p % 2 != 0;
+    const bool binary = p % 4 >= 2;
+    holder.publish(binary ? loadModel(linear ? "linear.bin" : "rbf.bin") : loadTinyModel(directory, tinyModels[linear ? 0 : 1]));
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  stop = true;
+  for (auto &reader : readers) reader.join();
+  holder.collect();
+  std::cout << predictions << " predictions were made during " << publishCount << " swaps." << '\n';
+  check(mismatches == 0, "A prediction did not come from the model of its snapshot.");
+  check(holder.getRetiredCount() == 0, "Retired models were not freed once the readers stopped.");
+  check(holder.getGeneration() == publishCount, "The generation is not the number of models published.");
+}
+
+// Trains on the inputs of tinyRbf labeled by it, each of them one to three times and the copies spread over the problem, and on the
+// same rows collapsed into weighted ones. Both are the same C-SVC problem, so the models may only differ by the tolerance of the solver.
+void checkCollapse(const std::string &directory) {
+  const auto source = loadTinyModel(directory, "tinyRbf");
+  const auto rows = makeInputs(*source, 5);
+  std::vector<std::vector<svm_node>> xs;
+  std::vector<double> ys;
+  for (size_t copy = 0; copy < 3; copy++) {
+    for (size_t i = 0; i < rows.size(); i++) {
+      if (copy > i % 3) continue;
+      xs.push_back(rows[i]);
+      ys.push_back(svm_predict(source.get(), rows[i].data()));
+    }
+  }
+  std::vector<std::vector<svm_node>> collapsedXs = xs;
+  std::vector<double> collapsedYs = ys;
+  std::vector<double> weights = collapseDuplicates(collapsedXs, collapsedYs);
+  check(collapsedXs.size() < xs.size() && std::accumulate(weights.begin(), weights.end(), 0.0) == xs.size(), "Collapsing lost or kept duplicates.");
+  std::cout << "Collapsed " << xs.size() << " rows into " << collapsedXs.size() << "." << '\n';
+  std::vector<svm_node *> pointers;
+  const svm_problem problem = problemOf(xs, ys, pointers);
+  std::vector<svm_node *> collapsedPointers;
+  svm_problem collapsedProblem = problemOf(collapsedXs, collapsedYs, collapsedPointers);
+  collapsedProblem.W = weights.data();
+  const auto inputs = makeInputs(*source, 20);
+  for (const char *name : tinyModels) {
+    // A small C puts most rows at their bound, which the weights scale, so training with wrong weights fails the check.
+    svm_parameter parameter = trainingParameterOf(*loadTinyModel(directory, name));
+    parameter.C = 0.01;
+    const ModelPointer model(svm_train(&problem, &parameter));
+    const ModelPointer collapsedModel(svm_train(&collapsedProblem, &parameter));
+    const auto decisionValues = decisionValuesOf(*model, inputs);
+    const auto collapsedDecisionValues = decisionValuesOf(*collapsedModel, inputs);
+    double largestDifference = 0;
+    for (size_t i = 0; i < decisionValues.size(); i++) largestDifference = std::max(largestDifference, std::fabs(collapsedDecisionValues[i] - decisionValues[i]));
+    std::cout << "With the kernel of " << name << ", the decision values differ by up to " << largestDifference << "." << '\n';
+    check(largestDifference <= 0.01, std::string("Training on the collapsed rows gives other decision values than on the duplicates with the kernel of ") + name + ".");
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const std::map<std::string, void (*)(const std::string &)> checks = {
+      {"early-exit", checkEarlyExit},
+      {"dag", checkDag},
+      {"batch", checkBatch},
+      {"compiled-model", checkCompiledModel},
+      {"quantized-model", checkQuantizedModel},
+      {"binary-format", checkBinaryFormat},
+      {"text-format", checkTextFormat},
+      {"compaction", checkCompaction},
+      {"model-swap", checkModelSwap},
+      {"collapse", checkCollapse},
+  };
+  const auto found = argc == 3 ? checks.find(argv[1]) : checks.end();
+  if (found == checks.end()) {
+    std::cout << "Usage: " << argv[0] << " [CHECK] [MODELS DIRECTORY]" << '\n';
+    return 1;
+  }
+  try {
+    found->second(argv[2]);
+  } catch (const std::exception &exception) {
+    std::cout << argv[1] << " failed: " << exception.what() << '\n';
+    return 1;
+  }
+  std::cout << argv[1] << " passed." << '\n';
+  return 0;
+}
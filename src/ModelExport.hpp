@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "SVM.h"
+
+// Writes classification models as C++ headers to be compiled into a program and predicted with EmbeddedPredictor.
+
+// Header files are written instead of model files when the file name ends in .hpp.
+inline bool isModelHeaderFile(const std::string &filename) {
+  const std::string extension = ".hpp";
+  return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// The struct of a header is named after its file with a Model suffix, such as digitsModel for models/digits.hpp, which keeps it from
+// colliding with a name from the standard library such as exp.
+inline std::string modelHeaderName(const std::string &filename) {
+  const auto slash = filename.find_last_of('/');
+  std::string name = filename.substr(slash == std::string::npos ? 0 : slash + 1);
+  name = name.substr(0, name.find('.'));
+  for (auto &c : name) {
+    if (std::isalnum(static_cast<unsigned char>(c)) == 0) c = '_';
+  }
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front())) != 0) name = "model" + name;
+  return name + "Model";
+}
+
+namespace detail {
+// The shortest text which reads back as exactly value.
+inline std::string exactNumber(double value) {
+  if (!std::isfinite(value)) throw std::invalid_argument("Models with infinite or NaN numbers cannot be exported as headers.");
+  char buffer[32];
+  const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  std::string text(buffer, result.ptr);
+  if (text.find_first_of(".e") == std::string::npos) text += ".0";
+  return text;
+}
+
+template <typename Number>
+void writeNumbers(std::ostream &stream, const Number *numbers, size_t count) {
+  stream << '{';
+  for (size_t i = 0; i < count; i++) {
+    if (i != 0) stream << ", ";
+    if constexpr (std::is_floating_point_v<Number>) {
+      stream << exactNumber(numbers[i]);
+    } else {
+      stream << numbers[i];
+    }
+  }
+  stream << '}';
+}
+
+inline void writeRows(std::ostream &stream, const std::vector<double> &rows, size_t width) {
+  stream << "{\n";
+  for (size_t r = 0; r * width < rows.size(); r++) {
+    stream << "      ";
+    writeNumbers(stream, rows.data() + r * width, width);
+    stream << ",\n";
+  }
+  stream << "  }";
+}
+} // namespace detail
+
+inline void exportModelHeader(const std::string &filename, const svm_model &model) {
+  const auto &param = model.param;
+  if (param.svm_type != C_SVC && param.svm_type != NU_SVC) throw std::invalid_argument("Only classification models can be exported as headers.");
+  if (param.kernel_type == PRECOMPUTED) throw std::invalid_argument("Models with precomputed kernels cannot be exported as headers.");
+  if (model.nr_class < 2) throw std::invalid_argument("Models with fewer than two classes cannot be exported as headers.");
+  if (param.kernel_type != LINEAR && model.l == 0) throw std::invalid_argument("Models without SVs can only be exported as headers with a linear kernel.");
+  const auto k = static_cast<size_t>(model.nr_class);
+  const auto l = static_cast<size_t>(model.l);
+  const size_t pairCount = k * (k - 1) / 2;
+  size_t dimension = 1;
+  for (size_t s = 0; s < l; s++) {
+    for (const svm_node *node = model.SV[s]; node->index != -1; node++) dimension = std::max(dimension, static_cast<size_t>(node->index));
+  }
+  std::vector<double> svs(l * dimension);
+  std::vector<double> svSquares(l);
+  for (size_t s = 0; s < l; s++) {
+    for (const svm_node *node = model.SV[s]; node->index != -1; node++) {
+      svs[s * dimension + node->index - 1] = node->value;
+      svSquares[s] += static_cast<double>(node->value) * node->value;
+    }
+  }
+  std::vector<size_t> starts(k + 1);
+  for (size_t i = 0; i < k; i++) starts[i + 1] = starts[i] + model.nSV[i];
+
+  // Written to memory first, so a number that cannot be exported leaves no partial file behind.
+  std::ostringstream stream;
+  const char *kernels[] = {"Linear", "Polynomial", "Rbf", "Sigmoid"};
+  stream << "// A model exported by convert-model, to be predicted with EmbeddedPredictor.\n";
+  stream << "#pragma once\n\n#include <cstddef>\n\n#include \"EmbeddedModel.hpp\"\n\n";
+  stream << "struct " << modelHeaderName(filename) << " {\n";
+  stream << "  static constexpr EmbeddedKernel kernel = EmbeddedKernel::" << kernels[param.kernel_type] << ";\n";
+  stream << "  static constexpr std::size_t classCount = " << k << ";\n";
+  stream << "  static constexpr std::size_t dimension = " << dimension << ";\n";
+  stream << "  static constexpr int labels[classCount] = ";
+  detail::writeNumbers(stream, model.label, k);
+  stream << ";\n  static constexpr double rhos[classCount * (classCount - 1) / 2] = ";
+  detail::writeNumbers(stream, model.rho, pairCount);
+  stream << ";\n";
+  if (param.kernel_type == LINEAR) {
+    // The decision function of each pair collapses to the weighted sum of its SVs.
+    std::vector<double> weights(pairCount * dimension);
+    size_t p = 0;
+    for (size_t i = 0; i < k; i++) {
+      for (size_t j = i + 1; j < k; j++) {
+        double *w = weights.data() + p * dimension;
+        for (size_t s = starts[i]; s < starts[i + 1]; s++) {
+          for (size_t d = 0; d < dimension; d++) w[d] += model.sv_coef[j - 1][s] * svs[s * dimension + d];
+        }
+        for (size_t s = starts[j]; s < starts[j + 1]; s++) {
+          for (size_t d = 0; d < dimension; d++) w[d] += model.sv_coef[i][s] * svs[s * dimension + d];
+        }
+        p++;
+      }
+    }
+    stream << "  alignas(64) static constexpr double weights[classCount * (classCount - 1) / 2][dimension] = ";
+    detail::writeRows(stream, weights, dimension);
+    stream << ";\n";
+  } else {
+    stream << "  static constexpr std::size_t svCount = " << l << ";\n";
+    stream << "  static constexpr int degree = " << param.degree << ";\n";
+    stream << "  static constexpr double gamma = " << detail::exactNumber(param.gamma) << ";\n";
+    stream << "  static constexpr double coef0 = " << detail::exactNumber(param.coef0) << ";\n";
+    stream << "  static constexpr std::size_t starts[classCount + 1] = ";
+    detail::writeNumbers(stream, starts.data(), k + 1);
+    stream << ";\n  static constexpr double svSquares[svCount] = ";
+    detail::writeNumbers(stream, svSquares.data(), l);
+    stream << ";\n  alignas(64) static constexpr double svs[svCount][dimension] = ";
+    detail::writeRows(stream, svs, dimension);
+    stream << ";\n  static constexpr double coefficients[classCount - 1][svCount] = {\n";
+    for (size_t i = 0; i + 1 < k; i++) {
+      stream << "      ";
+      detail::writeNumbers(stream, model.sv_coef[i], l);
+      stream << ",\n";
+    }
+    stream << "  };\n";
+  }
+  stream << "};\n";
+  std::ofstream file(filename);
+  if (!(file << stream.str()) || !file.flush()) throw std::runtime_error("Could not write " + filename + ".");
+}
@@ -0,0 +1 @@
+#include "ModelFile.hpp"
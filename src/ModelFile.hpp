@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "SVM.h"
+
+struct ModelDeleter {
+  void operator()(svm_model *model) const { svm_free_and_destroy_model(&model); }
+};
+
+using ModelPointer = std::unique_ptr<svm_model, ModelDeleter>;
+
+// Models are written in the binary format when the file name ends in .bin and in the text format otherwise.
+inline bool isBinaryModelFile(const std::string &filename) {
+  const std::string extension = ".bin";
+  return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+// Loads a model in either format, whatever the file name.
+inline ModelPointer loadModel(const std::string &filename) {
+  svm_model *model = svm_load_model_mmap(filename.c_str());
+  if (model == nullptr) model = svm_load_model(filename.c_str());
+  if (model == nullptr) throw std::runtime_error("Could not load the model from " + filename + ".");
+  return ModelPointer(model);
+}
+
+inline void saveModel(const std::string &filename, const svm_model *model) {
+  const auto status = isBinaryModelFile(filename) ? svm_save_model_binary(filename.c_str(), model) : svm_save_model(filename.c_str(), model);
+  if (status != 0) throw std::runtime_error("Could not save the model to " + filename + ".");
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "Aligned.hpp"
+#include "Duration.hpp"
+#include "ModelFile.hpp"
+#include "SVM.h"
+#include "Types.hpp"
+
+// Holds the current model of a long-running service and lets it be replaced while predictions are running.
+//
+// Readers take a Snapshot, which pins the model that was current at that moment, with two atomic stores and two loads and no lock.
+// A publisher swaps the pointer and retires the old model with the global epoch at the time of the swap. A retired model is freed with
+// svm_free_and_destroy_model once no reader slot is still in an epoch at or before that one, that is, once every reader which could have
+// seen it has finished.
+//
+// Each thread that reads claims one of maxReaders slots through a Reader, which it keeps for as long as it runs.
+class ModelHolder {
+ public:
+  static constexpr size_t maxReaders = 64;
+
+ private:
+  static constexpr U64 idle = ~U64{0};
+
+  struct alignas(cacheLineSize) ReaderSlot {
+    std::atomic<U64> epoch{idle};
+    std::atomic<bool> claimed{false};
+  };
+
+  std::atomic<svm_model *> current;
+  std::atomic<U64> globalEpoch{0};
+  ReaderSlot slots[maxReaders];
+  std::mutex publishMutex; // serializes publishers, never taken by readers
+  std::vector<std::pair<svm_model *, U64>> retired;
+  std::atomic<U64> generation{0};
+  std::atomic<bool> watching{false};
+  std::thread watcher;
+
+  // Frees the retired models no reader can still be using. Must be called with publishMutex held.
+  void reclaim() {
+    U64 oldestReader = idle;
+    for (const auto &slot : slots) oldestReader = std::min(oldestReader, slot.epoch.load());
+    for (auto it = retired.begin(); it != retired.end();) {
+      if (oldestReader == idle || it->second < oldestReader) {
+        ModelDeleter()(it->first);
+        it = retired.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+ public:
+  // Keeps a snapshot of the current model for as long as it exists.
+  class Snapshot {
+    std::atomic<U64> &epoch;
+    const svm_model *model;
+
+   public:
+    Snapshot(std::atomic<U64> &epoch, const std::atomic<U64> &globalEpoch, const std::atomic<svm_model *> &current) : epoch(epoch) {
+      // The slot is published before the pointer is read, so a publisher that swaps the pointer afterwards sees this reader.
+      epoch.store(globalEpoch.load());
+      model = current.load();
+    }
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    ~Snapshot() { epoch.store(idle, std::memory_order_release); }
+
+    const svm_model &operator*() const { return *model; }
+    const svm_model *get() const { return model; }
+  };
+
+  // The slot of one reading thread.
+  class Reader {
+    ModelHolder &holder;
+    ReaderSlot *slot = nullptr;
+
+   public:
+    explicit Reader(ModelHolder &holder) : holder(holder) {
+      for (auto &candidate : holder.slots) {
+        bool expected = false;
+        if (candidate.claimed.compare_exchange_strong(expected, true)) {
+          slot = &candidate;
+          return;
+        }
+      }
+      throw std::runtime_error("A model holder cannot have more than " + std::to_string(maxReaders) + " readers.");
+    }
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+    ~Reader() { slot->claimed.store(false, std::memory_order_release); }
+
+    // Only one snapshot of a reader may exist at a time.
+    Snapshot snapshot() const { return Snapshot(slot->epoch, holder.globalEpoch, holder.current); }
+  };
+
+  explicit ModelHolder(ModelPointer model) : current(model.release()) {}
+  ModelHolder(const ModelHolder &) = delete;
+  ModelHolder &operator=(const ModelHolder &) = delete;
+
+  // Must only be destroyed once no Reader is left.
+  ~ModelHolder() {
+    stopWatching();
+    for (const auto &entry : retired) ModelDeleter()(entry.first);
+    ModelDeleter()(current.load());
+  }
+
+  // Makes model the current one. The previous model is freed as soon as its readers are done, here or in a later publish or collect.
+  void publish(ModelPointer model) {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    svm_model *previous = current.exchange(model.release());
+    retired.emplace_back(previous, globalEpoch.fetch_add(1));
+    generation++;
+    reclaim();
+  }
+
+  // Frees the retired models whose readers are done.
+  void collect() {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    reclaim();
+  }
+
+  // How many times a model was published, so a reader can tell when derived state needs to be rebuilt.
+  U64 getGeneration() const { return generation.load(); }
+
+  size_t getRetiredCount() {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    return retired.size();
+  }
+
+  // Starts a thread which checks filename every interval and publishes the model in it when the file changed, text or binary.
+  // validate may throw to reject a model, which is then freed and the current one kept. Models should be replaced by renaming a
+  // complete file over the old one, because a binary model is mapped and must not change while in use.
+  void watch(const std::string &filename, Duration interval, std::function<void(const svm_model &)> validate) {
+    if (watching.exchange(true)) throw std::logic_error("A model holder can only watch one file.");
+    watcher = std::thread([this, filename, interval, validate]() {
+      const auto identify = [&]() {
+        struct stat status {};
+        if (stat(filename.c_str(), &status) != 0) return std::vector<U64>{};
+        return std::vector<U64>{static_cast<U64>(status.st_dev), static_cast<U64>(status.st_ino), static_cast<U64>(status.st_size),
+                                static_cast<U64>(status.st_mtim.tv_sec), static_cast<U64>(status.st_mtim.tv_nsec)};
+      };
+      auto identity = identify();
+      while (watching) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(interval.getNanoseconds()));
+        collect();
+        const auto newIdentity = identify();
+        if (newIdentity.empty() || newIdentity == identity) continue;
+        identity = newIdentity;
+        try {
+          ModelPointer model = loadModel(filename);
+          validate(*model);
+          publish(std::move(model));
+          std::cerr << "Loaded a new model from " << filename << "." << '\n';
+        } catch (const std::exception &exception) {
+          std::cerr << "Keeping the current model: " << exception.what() << '\n';
+        }
+      }
+    });
+  }
+
+  void stopWatching() {
+    if (!watching.exchange(false)) return;
+    watcher.join();
+  }
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "Clock.hpp"
+#include "Duration.hpp"
+#include "Image.hpp"
+#include "ModelHolder.hpp"
+#include "Queue.hpp"
+#include "SVM.h"
+#include "Socket.hpp"
+
+// Serves predictions of the model in a ModelHolder over a Unix domain socket.
+//
+// When a client connects, the server sends a uint32_t with the number of decision values of the model. After that, for every imageSize bytes
+// the client sends (one raw image, a byte per pixel), the server replies with the predicted label as an int32_t followed by that many doubles,
+// all in host byte order. A client may keep one image in flight per connection and open as many connections as it wants.
+//
+// Each connection has a thread which featurizes its images and hands them to a single batching thread, which waits for up to maxBatch images
+// or until maxWait has passed since the first one arrived and predicts them together with svm_predict_batch. A batch is closed early once it
+// holds every request in flight, as no connection can send another image before its reply, and the batcher sleeps while there are none.
+// Every batch is predicted with a snapshot of the current model, so the model can be replaced while serving without pausing.
+class PredictionServer {
+  struct Request {
+    std::vector<svm_node> nodes;
+    double label = 0;
+    std::vector<double> decisionValues;
+    bool done = false;
+    std::mutex mutex;
+    std::condition_variable condition;
+  };
+
+  struct Connection {
+    FileDescriptor socket;
+    std::thread thread;
+    std::atomic<bool> finished{false};
+  };
+
+  ModelHolder &models;
+  size_t maxBatch;
+  Duration maxWait;
+  uint32_t decisionValueCount;
+  MpmcQueue<Request *> requests{1024};
+  std::atomic<size_t> queuedCount{0};   // requests pushed or about to be, and not popped yet
+  std::atomic<size_t> inFlightCount{0}; // requests pushed or about to be, and not answered yet
+  std::mutex wakeMutex;
+  std::condition_variable wakeCondition; // signaled when a request is queued or the batcher has to stop
+  std::atomic<bool> batcherStopping{false};
+  std::atomic<U64> imageCount{0};
+  std::atomic<U64> batchCount{0};
+
+  void serveConnection(Connection &connection) {
+    const int socket = connection.socket.get();
+    try {
+      writeFully(socket, &decisionValueCount, sizeof(decisionValueCount));
+      Request request;
+      Image image;
+      std::vector<unsigned char> reply(sizeof(int32_t) + decisionValueCount * sizeof(double));
+      while (readFully(socket, image.data.data(), imageSize)) {
+        image.applyThreshold();
+        request.nodes = edgeCountersFromImage(image);
+        request.done = false;
+        inFlightCount++;
+        queuedCount++;
+        requests.push(&request);
+        {
+          // Taking the lock orders this with the check of a batcher about to wait, so the notification cannot be lost.
+          std::lock_guard<std::mutex> lock(wakeMutex);
+        }
+        wakeCondition.notify_one();
+        {
+          std::unique_lock<std::mutex> lock(request.mutex);
+          request.condition.wait(lock, [&]() { return request.done; });
+        }
+        const auto label = static_cast<int32_t>(request.label);
+        std::memcpy(reply.data(), &label, sizeof(label));
+        std::memcpy(reply.data() + sizeof(label), request.decisionValues.data(), decisionValueCount * sizeof(double));
+        writeFully(socket, reply.data(), reply.size());
+      }
+    } catch (const std::exception &exception) {
+      std::cerr << "Dropping a connection: " << exception.what() << '\n';
+    }
+    connection.finished = true;
+  }
+
+  bool popRequest(Request *&request) {
+    if (!requests.tryPop(request)) return false;
+    queuedCount--;
+    return true;
+  }
+
+  void runBatcher() {
+    std::vector<Request *> batch;
+    std::vector<const svm_node *> xs;
+    std::vector<double> predictions;
+    std::vector<double> decisionValues;
+    const ModelHolder::Reader reader(models);
+    Request *request = nullptr;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCondition.wait(lock, [&]() { return queuedCount > 0 || batcherStopping; });
+      }
+      // A request counted in queuedCount may not be visible in the queue yet, in which case this just waits again.
+      if (!popRequest(request)) {
+        if (batcherStopping && queuedCount == 0) return;
+        std::this_thread::yield();
+        continue;
+      }
+      Clock clock;
+      batch.assign(1, request);
+      while (batch.size() < maxBatch && batch.size() < inFlightCount) {
+        const Duration elapsed = clock.getElapsed();
+        if (elapsed >= maxWait) break;
+        if (popRequest(request)) {
+          batch.push_back(request);
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCondition.wait_for(lock, std::chrono::nanoseconds(maxWait.getNanoseconds() - elapsed.getNanoseconds()), [&]() { return queuedCount > 0; });
+      }
+      const auto n = static_cast<int>(batch.size());
+      xs.resize(n);
+      for (int i = 0; i < n; i++) xs[i] = batch[i]->nodes.data();
+      predictions.resize(n);
+      decisionValues.resize(static_cast<size_t>(n) * decisionValueCount);
+      {
+        const auto model = reader.snapshot();
+        // A single image gains nothing from blocking, which has to make every SV dense first.
+        if (n == 1) {
+          predictions[0] = svm_predict_values(model.get(), xs[0], decisionValues.data());
+        } else {
+          svm_predict_batch(model.get(), xs.data(), n, predictions.data(), decisionValues.data());
+        }
+      }
+      // Answered requests stop counting before their connections can send the next ones.
+      inFlightCount -= n;
+      for (int i = 0; i < n; i++) {
+        Request &finished = *batch[i];
+        // Notifying under the lock keeps the request alive until the notification is done, as its connection may end right after.
+        std::lock_guard<std::mutex> lock(finished.mutex);
+        finished.label = predictions[i];
+        finished.decisionValues.assign(decisionValues.begin() + i * decisionValueCount, decisionValues.begin() + (i + 1) * decisionValueCount);
+        finished.done = true;
+        finished.condition.notify_one();
+      }
+      imageCount += n;
+      batchCount++;
+    }
+  }
+
+ public:
+  static uint32_t countDecisionValues(const svm_model &model) {
+    const bool classification = model.param.svm_type == C_SVC || model.param.svm_type == NU_SVC;
+    return classification ? model.nr_class * (model.nr_class - 1) / 2 : 1;
+  }
+
+  PredictionServer(ModelHolder &models, size_t maxBatch, Duration maxWait) : models(models), maxBatch(maxBatch), maxWait(maxWait) {
+    if (maxBatch == 0) throw std::invalid_argument("The maximum batch size must be positive.");
+    decisionValueCount = countDecisionValues(*ModelHolder::Reader(models).snapshot());
+  }
+
+  // Throws unless model can replace the served one, which it cannot if the replies to it would have a different size.
+  void checkReplacement(const svm_model &model) const {
+    if (countDecisionValues(model) != decisionValueCount) throw std::invalid_argument("The new model has a different number of decision values.");
+  }
+
+  // Accepts connections on socketPath until stop becomes true, then closes every connection and returns.
+  void run(const std::string &socketPath, const std::atomic<bool> &stop) {
+    const FileDescriptor listener = listenOnUnixSocket(socketPath);
+    std::thread batcher(&PredictionServer::runBatcher, this);
+    std::list<Connection> connections;
+    while (!stop) {
+      pollfd descriptor{listener.get(), POLLIN, 0};
+      const int ready = poll(&descriptor, 1, 100);
+      if (ready == -1 && errno != EINTR) throw systemError("Could not poll " + socketPath);
+      for (auto it = connections.begin(); it != connections.end();) {
+        if (it->finished) {
+          it->thread.join();
+          it = connections.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (ready <= 0) continue;
+      FileDescriptor socket(accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC));
+      if (socket.get() == -1) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        throw systemError("Could not accept a connection on " + socketPath);
+      }
+      Connection &connection = connections.emplace_back();
+      connection.socket = std::move(socket);
+      connection.thread = std::thread(&PredictionServer::serveConnection, this, std::ref(connection));
+    }
+    // Unblocks the connection threads waiting for their next image; an image already sent is still answered.
+    for (auto &connection : connections) shutdown(connection.socket.get(), SHUT_RD);
+    for (auto &connection : connections) connection.thread.join();
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex);
+      batcherStopping = true;
+    }
+    wakeCondition.notify_one();
+    batcher.join();
+    unlink(socketPath.c_str());
+  }
+
+  U64 getImageCount() const { return imageCount; }
+  U64 getBatchCount() const { return batchCount; }
+};
@@ -0,0 +1 @@
+#include "Predictor.hpp"
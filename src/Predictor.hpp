@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "SVM.h"
+
+// Predicts with an svm_model through buffers sized once, so predict() never touches the heap.
+// The classes are decided like svm_predict_mode does with the decision mode given when constructing.
+// The model must outlive the Predictor. A Predictor is not thread-safe, use one per thread.
+class Predictor {
+  const svm_model *model;
+  int decisionMode;
+  std::vector<int> start;
+  std::vector<double> kvalue;
+  std::vector<int> vote;
+  std::vector<int> lost;
+  std::vector<char> ready;
+  std::vector<char> played;
+  std::vector<double> decisionValues;
+
+ public:
+  explicit Predictor(const svm_model *model, int decisionMode = MAX_WINS)
+      : model(model), decisionMode(decisionMode), start(model->nr_class), kvalue(model->l), vote(model->nr_class), lost(model->nr_class), ready(model->nr_class),
+        played(static_cast<size_t>(model->nr_class) * model->nr_class), decisionValues(std::max(1, model->nr_class * (model->nr_class - 1) / 2)) {
+    svm_get_sv_start(model, start.data());
+  }
+
+  double predict(const svm_node *x) {
+    svm_workspace workspace{start.data(), kvalue.data(), vote.data(), lost.data(), ready.data(), played.data()};
+    return svm_predict_mode_workspace(model, x, decisionMode, decisionValues.data(), &workspace);
+  }
+
+  // The decision values of the last prediction, which only MAX_WINS computes all of.
+  const std::vector<double> &getDecisionValues() const { return decisionValues; }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QUANTIZED_MODEL_X86
+#endif
+
+#include "Aligned.hpp"
+#include "KernelFunction.hpp"
+#include "SVM.h"
+
+namespace quantized {
+
+// Largest magnitude of a quantized input or weight. With both in [-127, 127] the pairwise sums of pmaddubsw stay within int16.
+constexpr int maximumLevel = 127;
+
+// out[r] = dot(x, rows + r * stride) for count rows, stride being a multiple of 32.
+using DotsFunction = void (*)(const uint8_t *x, const int8_t *rows, size_t count, size_t stride, int32_t *out);
+
+inline void dotsScalar(const uint8_t *x, const int8_t *rows, size_t count, size_t stride, int32_t *out) {
+  for (size_t r = 0; r < count; r++) {
+    const int8_t *row = rows + r * stride;
+    int32_t sum = 0;
+    for (size_t d = 0; d < stride; d++) sum += static_cast<int32_t>(x[d]) * row[d];
+    out[r] = sum;
+  }
+}
+
+#ifdef QUANTIZED_MODEL_X86
+__attribute__((target("avx2"))) inline int32_t horizontalSum(__m256i sum) {
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+  return _mm_cvtsi128_si32(half);
+}
+
+// pmaddubsw multiplies unsigned by signed bytes and adds adjacent pairs into int16, pmaddwd widens those to int32.
+__attribute__((target("avx2"))) inline void dotsAvx2(const uint8_t *x, const int8_t *rows, size_t count, size_t stride, int32_t *out) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  for (size_t r = 0; r < count; r++) {
+    const int8_t *row = rows + r * stride;
+    __m256i sum = _mm256_setzero_si256();
+    for (size_t d = 0; d < stride; d += 32) {
+      const __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(x + d));
+      const __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + d));
+      sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), ones));
+    }
+    out[r] = horizontalSum(sum);
+  }
+}
+
+// vpdpbusd does the multiplication, the pairwise and the widening sums of the AVX2 version in one instruction.
+__attribute__((target("avx2,avxvnni"))) inline void dotsAvxVnni(const uint8_t *x, const int8_t *rows, size_t count, size_t stride, int32_t *out) {
+  for (size_t r = 0; r < count; r++) {
+    const int8_t *row = rows + r * stride;
+    __m256i sum = _mm256_setzero_si256();
+    for (size_t d = 0; d < stride; d += 32) {
+      const __m256i a = _mm256_load_si256(reinterpret_cast<const __m256i *>(x + d));
+      const __m256i b = _mm256_load_si256(reinterpret_cast<const __m256i *>(row + d));
+      sum = _mm256_dpbusd_avx_epi32(sum, a, b);
+    }
+    out[r] = horizontalSum(sum);
+  }
+}
+#endif
+
+struct DotsImplementation {
+  DotsFunction function;
+  const char *name;
+};
+
+// The fastest implementation the CPU running the program supports.
+inline DotsImplementation selectDots() {
+#ifdef QUANTIZED_MODEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("avxvnni")) return {dotsAvxVnni, "AVX-VNNI"};
+  if (__builtin_cpu_supports("avx2")) return {dotsAvx2, "AVX2"};
+#endif
+  return {dotsScalar, "scalar"};
+}
+
+// Scale mapping the largest magnitude of values to maximumLevel, 1 if they are all zero.
+inline double levelScale(const double *values, size_t count) {
+  double largest = 0;
+  for (size_t i = 0; i < count; i++) largest = std::max(largest, std::fabs(values[i]));
+  return largest == 0 ? 1.0 : maximumLevel / largest;
+}
+
+inline int8_t quantize(double value, double scale) { return static_cast<int8_t>(std::clamp(std::lround(value * scale), -static_cast<long>(maximumLevel), static_cast<long>(maximumLevel))); }
+
+} // namespace quantized
+
+// An svm_model with its dot products done in 8-bit integers, for deployment where some accuracy can be traded for throughput.
+//
+// Inputs are multiplied by inputScale and rounded to [0, 127], so features must be non-negative; with the default scale of 1, small integer
+// features such as the edge counters are represented exactly.
+// A linear model is collapsed into one weight vector per class pair, quantized to int8 with a scale per pair, so a prediction is one integer
+// dot product per pair. Other kernels keep their SVs, each quantized to int8 with its own scale, and compute the kernel from the integer dot
+// product; their coefficients stay in double.
+// The dot products use vpdpbusd (AVX-VNNI) or pmaddubsw (AVX2) when the CPU has them, chosen at run time, and plain C++ otherwise.
+// Classes are decided by max-wins voting.
+class QuantizedModel {
+  int kernelType;
+  int degree;
+  double gamma;
+  double coef0;
+  double inputScale;
+  size_t classCount;
+  size_t pairCount;
+  size_t rowCount; // weight vectors for a linear model, SVs otherwise
+  size_t dimension;
+  size_t stride;
+  AlignedArray<int8_t> rows;      // rowCount x stride
+  std::vector<double> rowScales;  // the value of one unit of a row's dot product with the quantized input
+  std::vector<double> rowSquares; // squared norms of the dequantized SVs, for RBF
+  std::vector<double> coefficients;
+  std::vector<size_t> pairOffsets;
+  std::vector<double> rhos;
+  std::vector<int> labels;
+  std::vector<int> starts;
+  quantized::DotsImplementation dots = quantized::selectDots();
+
+  double kernel(double dot, double xSquare, double svSquare) const { return kernels::fromDot(kernelType, dot, xSquare + svSquare, gamma, coef0, degree); }
+
+  void quantizeRow(size_t r, const std::vector<double> &values) {
+    const double scale = quantized::levelScale(values.data(), dimension);
+    int8_t *row = rows.get() + r * stride;
+    double square = 0;
+    for (size_t d = 0; d < dimension; d++) {
+      row[d] = quantized::quantize(values[d], scale);
+      square += (row[d] / scale) * (row[d] / scale);
+    }
+    rowScales[r] = 1.0 / (scale * inputScale);
+    rowSquares[r] = square;
+  }
+
+ public:
+  // Per-thread scratch space of predict(), sized for one model.
+  class Workspace {
+    friend class QuantizedModel;
+    AlignedArray<uint8_t> x;
+    std::vector<int32_t> dots;
+    std::vector<double> kvalues;
+    std::vector<int> votes;
+
+   public:
+    explicit Workspace(const QuantizedModel &model)
+        : x(makeAlignedArray<uint8_t>(model.stride)), dots(model.rowCount), kvalues(model.rowCount), votes(model.classCount) {}
+  };
+
+  explicit QuantizedModel(const svm_model &model, double inputScale = 1.0)
+      : kernelType(model.param.kernel_type), degree(model.param.degree), gamma(model.param.gamma), coef0(model.param.coef0), inputScale(inputScale),
+        classCount(model.nr_class), pairCount(classCount * (classCount - 1) / 2) {
+    if (model.param.svm_type != C_SVC && model.param.svm_type != NU_SVC) throw std::invalid_argument("Only classification models can be quantized.");
+    if (kernelType == PRECOMPUTED) throw std::invalid_argument("Models with precomputed kernels cannot be quantized.");
+    if (!(inputScale > 0)) throw std::invalid_argument("The input scale must be positive.");
+    dimension = 0;
+    for (int i = 0; i < model.l; i++) {
+      for (const svm_node *node = model.SV[i]; node->index != -1; node++) dimension = std::max(dimension, static_cast<size_t>(node->index));
+    }
+    stride = roundUpToCacheLine(std::max<size_t>(dimension, 1));
+    labels.assign(model.label, model.label + classCount);
+    starts.assign(classCount + 1, 0);
+    for (size_t i = 0; i < classCount; i++) starts[i + 1] = starts[i] + model.nSV[i];
+    rhos.assign(model.rho, model.rho + pairCount);
+    std::vector<std::vector<double>> svs(model.l, std::vector<double>(dimension));
+    for (int i = 0; i < model.l; i++) {
+      for (const svm_node *node = model.SV[i]; node->index != -1; node++) {
+        if (node->index >= 1) svs[i][node->index - 1] = node->value;
+      }
+    }
+
+    rowCount = kernelType == LINEAR ? pairCount : static_cast<size_t>(model.l);
+    rows = makeAlignedArray<int8_t>(rowCount * stride);
+    rowScales.resize(rowCount);
+    rowSquares.resize(rowCount);
+    if (kernelType == LINEAR) {
+      // Classifier (i, j) has the coefficients of the SVs of class i in sv_coef[j - 1] and the ones of class j in sv_coef[i].
+      size_t p = 0;
+      std::vector<double> weights(dimension);
+      for (size_t i = 0; i < classCount; i++) {
+        for (size_t j = i + 1; j < classCount; j++) {
+          std::fill(weights.begin(), weights.end(), 0.0);
+          for (int k = starts[i]; k < starts[i + 1]; k++) {
+            for (size_t d = 0; d < dimension; d++) weights[d] += model.sv_coef[j - 1][k] * svs[k][d];
+          }
+          for (int k = starts[j]; k < starts[j + 1]; k++) {
+            for (size_t d = 0; d < dimension; d++) weights[d] += model.sv_coef[i][k] * svs[k][d];
+          }
+          quantizeRow(p++, weights);
+        }
+      }
+    } else {
+      for (size_t r = 0; r < rowCount; r++) quantizeRow(r, svs[r]);
+      for (size_t i = 0; i < classCount; i++) {
+        for (size_t j = i + 1; j < classCount; j++) {
+          pairOffsets.push_back(coefficients.size());
+          for (int k = starts[i]; k < starts[i + 1]; k++) coefficients.push_back(model.sv_coef[j - 1][k]);
+          for (int k = starts[j]; k < starts[j + 1]; k++) coefficients.push_back(model.sv_coef[i][k]);
+        }
+      }
+    }
+  }
+
+  // The name of the instruction set the dot products use on this CPU.
+  const char *getInstructionSet() const { return dots.name; }
+
+  size_t getSizeInBytes() const { return rowCount * stride + (rowScales.size() + rowSquares.size() + coefficients.size() + rhos.size()) * sizeof(double); }
+
+  double predict(const svm_node *x, Workspace &workspace) const {
+    uint8_t *input = workspace.x.get();
+    std::fill(input, input + stride, uint8_t{0});
+    double xSquare = 0;
+    for (const svm_node *node = x; node->index != -1; node++) {
+      if (node->index < 1 || static_cast<size_t>(node->index) > dimension) continue;
+      const auto level = std::clamp(std::lround(node->value * inputScale), 0L, static_cast<long>(quantized::maximumLevel));
+      input[node->index - 1] = static_cast<uint8_t>(level);
+      xSquare += (level / inputScale) * (level / inputScale);
+    }
+    int32_t *dots = workspace.dots.data();
+    this->dots.function(input, rows.get(), rowCount, stride, dots);
+    int *votes = workspace.votes.data();
+    std::fill(votes, votes + classCount, 0);
+    const double *kvalues = workspace.kvalues.data();
+    if (kernelType != LINEAR) {
+      for (size_t r = 0; r < rowCount; r++) workspace.kvalues[r] = kernel(dots[r] * rowScales[r], xSquare, rowSquares[r]);
+    }
+    size_t p = 0;
+    for (size_t i = 0; i < classCount; i++) {
+      for (size_t j = i + 1; j < classCount; j++) {
+        double sum;
+        if (kernelType == LINEAR) {
+          sum = dots[p] * rowScales[p];
+        } else {
+          const double *coefficient = coefficients.data() + pairOffsets[p];
+          sum = 0;
+          for (int k = starts[i]; k < starts[i + 1]; k++) sum += *coefficient++ * kvalues[k];
+          for (int k = starts[j]; k < starts[j + 1]; k++) sum += *coefficient++ * kvalues[k];
+        }
+        if (sum - rhos[p] > 0) {
+          votes[i]++;
+        } else {
+          votes[j]++;
+        }
+        p++;
+      }
+    }
+    size_t best = 0;
+    for (size_t i = 1; i < classCount; i++) {
+      if (votes[i] > votes[best]) best = i;
+    }
+    return labels[best];
+  }
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "Aligned.hpp"
+#include "Clock.hpp"
+#include "Duration.hpp"
+#include "Types.hpp"
+
+// Counters a queue keeps so a pipeline can tell which of its stages limits throughput.
+// A producer stalls when the queue is full (the consumer is the bottleneck), a consumer stalls when it is empty (the producer is).
+class QueueStatistics {
+  std::atomic<U64> pushes{0};
+  std::atomic<U64> depthSum{0};
+  std::atomic<U64> maximumDepth{0};
+  std::atomic<U64> pushStall{0};
+  std::atomic<U64> popStall{0};
+
+ public:
+  void recordPush(U64 depth) {
+    pushes.fetch_add(1, std::memory_order_relaxed);
+    depthSum.fetch_add(depth, std::memory_order_relaxed);
+    U64 maximum = maximumDepth.load(std::memory_order_relaxed);
+    while (depth > maximum && !maximumDepth.compare_exchange_weak(maximum, depth, std::memory_order_relaxed)) {
+    }
+  }
+  void recordPushStall(Duration duration) { pushStall.fetch_add(duration.getNanoseconds(), std::memory_order_relaxed); }
+  void recordPopStall(Duration duration) { popStall.fetch_add(duration.getNanoseconds(), std::memory_order_relaxed); }
+
+  U64 getPushes() const { return pushes.load(std::memory_order_relaxed); }
+  // The average number of elements found in the queue by a push, including the pushed one.
+  double getAverageDepth() const {
+    const U64 count = getPushes();
+    return count == 0 ? 0.0 : depthSum.load(std::memory_order_relaxed) / static_cast<double>(count);
+  }
+  U64 getMaximumDepth() const { return maximumDepth.load(std::memory_order_relaxed); }
+  Duration getPushStall() const { return Duration{pushStall.load(std::memory_order_relaxed)}; }
+  Duration getPopStall() const { return Duration{popStall.load(std::memory_order_relaxed)}; }
+};
+
+namespace detail {
+
+// Retries operation until it succeeds and returns how long that took.
+// It spins first, then yields, then sleeps, so a stage waiting a long time for its neighbour does not take the cores it needs.
+// The clock is only read once the first attempt fails, so an uncontended queue pays nothing for the statistics.
+template <typename Operation>
+Duration retryUntil(Operation operation) {
+  if (operation()) return Duration{0};
+  Clock clock;
+  for (unsigned attempt = 1; !operation(); attempt++) {
+    if (attempt > 1024) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    } else if (attempt > 64) {
+      std::this_thread::yield();
+    }
+  }
+  return clock.getElapsed();
+}
+
+inline size_t checkedCapacity(size_t capacity) {
+  if (capacity < 2 || (capacity & (capacity - 1)) != 0) throw std::invalid_argument("The capacity of a queue must be a power of two of at least 2.");
+  return capacity;
+}
+
+} // namespace detail
+
+// A bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T>
+class SpscQueue {
+  std::vector<T> cells;
+  size_t mask;
+  QueueStatistics statistics;
+  alignas(cacheLineSize) std::atomic<size_t> head{0}; // next cell to pop, written by the consumer
+  alignas(cacheLineSize) std::atomic<size_t> tail{0}; // next cell to push, written by the producer
+  std::atomic<bool> closed{false};
+
+ public:
+  explicit SpscQueue(size_t capacity) : cells(detail::checkedCapacity(capacity)), mask(capacity - 1) {}
+
+  bool tryPush(T &value) {
+    const size_t position = tail.load(std::memory_order_relaxed);
+    const size_t depth = position - head.load(std::memory_order_acquire);
+    if (depth > mask) return false;
+    cells[position & mask] = std::move(value);
+    tail.store(position + 1, std::memory_order_release);
+    statistics.recordPush(depth + 1);
+    return true;
+  }
+
+  bool tryPop(T &value) {
+    const size_t position = head.load(std::memory_order_relaxed);
+    if (position == tail.load(std::memory_order_acquire)) return false;
+    value = std::move(cells[position & mask]);
+    head.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Once the queue is closed, push() drops its value and pop() returns a default value when the queue is empty, instead of waiting.
+  void close() { closed.store(true, std::memory_order_release); }
+
+  void push(T value) { statistics.recordPushStall(detail::retryUntil([&]() { return closed.load(std::memory_order_acquire) || tryPush(value); })); }
+
+  T pop() {
+    T value;
+    statistics.recordPopStall(detail::retryUntil([&]() { return tryPop(value) || closed.load(std::memory_order_acquire); }));
+    return value;
+  }
+
+  const QueueStatistics &getStatistics() const { return statistics; }
+};
+
+// A bounded lock-free queue for any number of producer and consumer threads (Vyukov's array queue).
+// Every cell carries a sequence number telling whether it is ready to be written or read in the current lap.
+template <typename T>
+class MpmcQueue {
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::vector<Cell> cells;
+  size_t mask;
+  QueueStatistics statistics;
+  alignas(cacheLineSize) std::atomic<size_t> enqueuePosition{0};
+  alignas(cacheLineSize) std::atomic<size_t> dequeuePosition{0};
+  std::atomic<bool> closed{false};
+
+ public:
+  explicit MpmcQueue(size_t capacity) : cells(detail::checkedCapacity(capacity)), mask(capacity - 1) {
+    for (size_t i = 0; i < cells.size(); i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool tryPush(T &value) {
+    size_t position = enqueuePosition.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[position & mask];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+      if (difference == 0) {
+        if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(position + 1, std::memory_order_release);
+          const size_t dequeued = dequeuePosition.load(std::memory_order_relaxed);
+          statistics.recordPush(dequeued > position ? 1 : std::min(position + 1 - dequeued, cells.size()));
+          return true;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool tryPop(T &value) {
+    size_t position = dequeuePosition.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell &cell = cells[position & mask];
+      const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+      if (difference == 0) {
+        if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.sequence.store(position + mask + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = dequeuePosition.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Once the queue is closed, push() drops its value and pop() returns a default value when the queue is empty, instead of waiting.
+  void close() { closed.store(true, std::memory_order_release); }
+
+  void push(T value) { statistics.recordPushStall(detail::retryUntil([&]() { return closed.load(std::memory_order_acquire) || tryPush(value); })); }
+
+  T pop() {
+    T value;
+    statistics.recordPopStall(detail::retryUntil([&]() { return tryPop(value) || closed.load(std::memory_order_acquire); }));
+    return value;
+  }
+
+  const QueueStatistics &getStatistics() const { return statistics; }
+};
@@ -1,16 +1,29 @@
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <csignal>
 #include <cstring>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <numeric>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "SVM.h"
 
+#include "CompiledModel.hpp"
+#include "Duplicates.hpp"
+#include "Image.hpp"
+#include "ModelFile.hpp"
+#include "ModelHolder.hpp"
+#include "PredictionServer.hpp"
+#include "QuantizedModel.hpp"
+#include "Queue.hpp"
+#include "Socket.hpp"
 #include "String.hpp"
 #include "Timer.hpp"
 
@@ -18,35 +31,17 @@ constexpr double svmEps = 0.001;
 
 constexpr double cacheSize = 1024;
 
-constexpr size_t imageSide = 28;
-constexpr size_t imageSize = imageSide * imageSide;
-constexpr size_t threshold = 1;
+constexpr size_t minimumImagesPerThread = 256;
 
-using Label = uint8_t;
+constexpr size_t defaultBatchSize = 1024;
 
-class Image {
- public:
-  std::array<uint8_t, imageSize> data{};
-  void applyThreshold() {
-    for (auto &pixel : data) {
-      if (pixel < threshold) {
-        pixel = 0;
-      } else {
-        pixel = 1;
-      }
-    }
-  }
-  uint8_t operator[](size_t i) const { return data[i]; }
-  uint8_t &operator[](size_t i) { return data[i]; }
-};
+constexpr size_t pipelineQueueCapacity = 8;
 
-class LabeledImage {
- public:
-  std::optional<Label> label;
-  Image image;
+constexpr size_t defaultServeBatch = 64;
 
-  LabeledImage(std::optional<Label> label, const Image &image) : label(label), image(image) {}
-};
+constexpr int defaultServeWaitMicroseconds = 200;
+
+constexpr Seconds modelWatchInterval = 1.0;
 
 std::string padString(std::string string, size_t digits) {
   if (string.size() >= digits) return string;
@@ -57,141 +52,541 @@ std::string padString(std::string string, size_t digits) {
   return result;
 }
 
-std::vector<svm_node> simpleNodesFromImage(const Image &image) {
-  std::vector<svm_node> nodes;
-  for (size_t i = 0; i < imageSize; i++) {
-    if (image[i] != 0) {
-      nodes.push_back(svm_node{});
-      nodes.back().index = static_cast<int>(i + 1);
-      nodes.back().value = image[i];
-    }
+using ConfusionMatrix = std::vector<std::vector<uint32_t>>;
+
+// Predicts count labeled images with a compiled or quantized model and returns results[label][prediction].
+// The images are split into one contiguous shard per thread; each thread featurizes and predicts its shard into its own matrix,
+// and the matrices are summed at the end.
+template <typename Model>
+ConfusionMatrix evaluate(const Model &model, const LabeledImage *images, size_t count) {
+  const size_t threadCount = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), count / minimumImagesPerThread));
+  std::vector<ConfusionMatrix> threadResults(threadCount, ConfusionMatrix(10, std::vector<uint32_t>(10)));
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < threadCount; t++) {
+    threads.emplace_back([&, t]() {
+      typename Model::Workspace workspace(model);
+      for (size_t i = t * count / threadCount; i < (t + 1) * count / threadCount; i++) {
+        const auto nodes = edgeCountersFromImage(images[i].image);
+        const auto prediction = static_cast<size_t>(model.predict(nodes.data(), workspace));
+        threadResults[t][images[i].label.value()][prediction]++;
+      }
+    });
   }
-  nodes.push_back(svm_node{});
-  nodes.back().index = -1;
-  nodes.back().value = 0;
-  return nodes;
-}
-
-std::vector<svm_node> edgeCountersFromImage(const Image &image) {
-  std::vector<size_t> edges(2 * imageSide);
-  for (size_t i = 1; i < imageSide; i++) {
-    for (size_t j = 1; j < imageSide; j++) {
-      if (image[i * imageSide + j] != image[(i - 1) * imageSide + j]) edges[i]++;
-      if (image[i * imageSide + j] != image[i * imageSide + (j - 1)]) edges[imageSide + j]++;
+  for (auto &thread : threads) thread.join();
+  ConfusionMatrix results(10, std::vector<uint32_t>(10));
+  for (const auto &threadResult : threadResults) {
+    for (size_t r = 0; r < 10; r++) {
+      for (size_t c = 0; c < 10; c++) results[r][c] += threadResult[r][c];
     }
   }
-  std::vector<svm_node> nodes;
-  for (size_t i = 0; i < 2 * imageSide; i++) {
-    if (edges[i] != 0) {
-      nodes.push_back(svm_node{});
-      nodes.back().index = static_cast<int>(i + 1);
-      nodes.back().value = edges[i];
+  return results;
+}
+
+std::vector<LabeledImage> readThresholdedImages(const std::string &filename, bool labeled) {
+  Timer timer;
+  timer.start();
+  std::cout << "Reading images...";
+  std::cout.flush();
+  std::vector<LabeledImage> images = readImagesFromFile(filename, labeled);
+  for (auto &labeledImage : images) labeledImage.image.applyThreshold();
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+  return images;
+}
+
+void printResults(const ConfusionMatrix &results) {
+  size_t right = 0;
+  size_t wrong = 0;
+  for (size_t r = 0; r < 10; r++) {
+    const auto &row = results[r];
+    std::vector<std::pair<int, int>> predictions;
+    for (size_t i = 0; i < 10; i++) {
+      predictions.emplace_back(row[i], i);
+      if (i == r) {
+        right += row[i];
+      } else {
+        wrong += row[i];
+      }
     }
-  }
-  nodes.push_back(svm_node{});
-  nodes.back().index = -1;
-  nodes.back().value = 0;
-  return nodes;
-}
-
-std::vector<LabeledImage> readImagesFromFile(const std::string &filename, bool labeled) {
-  std::vector<LabeledImage> labeledImages;
-  std::ifstream ifs(filename);
-  ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-  uint16_t value;
-  while (ifs >> value) {
-    std::optional<Label> optionalLabel;
-    if (labeled) optionalLabel = static_cast<Label>(value);
-    Image image;
-    if (!labeled) image[0] = static_cast<uint8_t>(value);
-    for (size_t j = labeled ? 0 : 1; j < imageSize; j++) {
-      char comma;
-      ifs >> comma >> value;
-      image[j] = static_cast<uint8_t>(value);
+    std::sort(rbegin(predictions), rend(predictions));
+    for (int i = 0; i < 10; i++) {
+      if (predictions[i].first) {
+        std::cout << r << " >> " << predictions[i].second << ": " << padString(std::to_string(predictions[i].first), 10) << "\n";
+      }
     }
-    labeledImages.emplace_back(optionalLabel, image);
   }
-  return labeledImages;
+  std::cout << "Got " << right << " of " << (right + wrong) << "." << ' ';
+  std::cout << "Rate is " << right / (double)(right + wrong) << "." << '\n';
 }
 
-int main(int argc, char **argv) {
-  if (argc < 4) {
-    std::cout << "Usage: " << argv[0] << " [TRAINING FILE] [N] [M] (TESTING FILE)" << '\n';
-    return 1;
+// The parameters every command that trains uses.
+svm_parameter trainingParameter() {
+  svm_parameter parameter{};
+  parameter.svm_type = C_SVC;
+  parameter.kernel_type = LINEAR;
+  parameter.cache_size = cacheSize;
+  parameter.C = 1.0;
+  parameter.eps = svmEps;
+  return parameter;
+}
+
+// recognize train [TRAINING FILE] [N] [MODEL FILE] (SV BUDGET) (PAIR SV BUDGET) (COLLAPSE DUPLICATES)
+// The budgets cap the SVs of the whole model and of each pair of classes, which bounds the prediction latency; 0 means no limit.
+// Collapsing duplicates is off unless 1 is given, as it hashes every image and makes the SV indices of the model refer to the collapsed images.
+int train(const std::vector<std::string> &arguments) {
+  const std::string trainingFile = arguments[0];
+  const int n = stringToInteger(arguments[1]);
+  const std::string modelFile = arguments[2];
+  std::vector<LabeledImage> trainingImages = readThresholdedImages(trainingFile, true);
+  if (static_cast<unsigned>(n) > trainingImages.size()) throw std::runtime_error("Not enough training images.");
+  std::vector<double> ys(n);
+  for (int i = 0; i < n; i++) ys[i] = trainingImages[i].label.value();
+  std::vector<std::vector<svm_node>> xs;
+  for (int i = 0; i < n; i++) xs.push_back(edgeCountersFromImage(trainingImages[i].image));
+  const bool collapse = arguments.size() > 5 && stringToInteger(arguments[5]) != 0;
+  std::vector<double> weights;
+  if (collapse) {
+    weights = collapseDuplicates(xs, ys);
+    std::cout << "Collapsed " << n << " images into " << xs.size() << " distinct ones." << '\n';
   }
-  std::string trainingFile = argv[1];
-  int n = stringToInteger(argv[2]);
-  int m = stringToInteger(argv[3]);
-  std::string testingFile;
-  if (argc >= 5) testingFile = argv[4];
+  svm_problem problem{};
+  problem.l = static_cast<int>(xs.size());
+  problem.y = ys.data();
+  std::vector<svm_node *> pointersToXs;
+  for (auto &x : xs) pointersToXs.push_back(x.data());
+  problem.x = pointersToXs.data();
+  // Without duplicates every weight is 1, so none are passed and the problem is the same as without collapsing.
+  problem.W = xs.size() < static_cast<size_t>(n) ? weights.data() : nullptr;
+  svm_parameter parameter = trainingParameter();
+  parameter.sv_budget = arguments.size() > 3 ? stringToInteger(arguments[3]) : 0;
+  parameter.pair_sv_budget = arguments.size() > 4 ? stringToInteger(arguments[4]) : 0;
+  const auto error_message = svm_check_parameter(&problem, &parameter);
+  if (error_message) throw std::runtime_error(error_message);
   Timer timer;
+  std::cout << "Training model...";
+  std::cout.flush();
   timer.start();
-  std::cout << "Reading images...";
+  // The model points into xs, so it is saved before they go away.
+  const ModelPointer model(svm_train(&problem, &parameter));
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+  std::cout << "The model has " << model->l << " SVs." << '\n';
+  std::cout << "Saving model...";
   std::cout.flush();
-  std::vector<LabeledImage> trainingImages = readImagesFromFile(trainingFile, true);
-  if (static_cast<unsigned>(n + m) > trainingImages.size()) throw std::runtime_error("Not enough training images.");
-  std::vector<LabeledImage> testingImages;
-  if (!testingFile.empty()) readImagesFromFile(testingFile, false);
-  for (auto &labeledImage : trainingImages) labeledImage.image.applyThreshold();
-  for (auto &labeledImage : testingImages) labeledImage.image.applyThreshold();
+  timer.restart();
+  saveModel(modelFile, model.get());
   timer.stop();
   std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
-  svm_problem problem{};
-  problem.l = n;
+  return 0;
+}
+
+// recognize cv [TRAINING FILE] [N] [FOLDS] (THREADS)
+// Cross validates the first N images with svm_cross_validation and then svm_cross_validation_parallel, which must predict the same labels.
+// THREADS is the nr_thread of the parallel run, 0 (the default) for one per core.
+int crossValidate(const std::vector<std::string> &arguments) {
+  const int n = stringToInteger(arguments[1]);
+  const int folds = stringToInteger(arguments[2]);
+  if (folds < 2) throw std::invalid_argument("There must be at least two folds.");
+  std::vector<LabeledImage> trainingImages = readThresholdedImages(arguments[0], true);
+  if (static_cast<unsigned>(n) > trainingImages.size()) throw std::runtime_error("Not enough training images.");
   std::vector<double> ys(n);
   for (int i = 0; i < n; i++) ys[i] = trainingImages[i].label.value();
-  problem.y = ys.data();
   std::vector<std::vector<svm_node>> xs;
   for (int i = 0; i < n; i++) xs.push_back(edgeCountersFromImage(trainingImages[i].image));
+  svm_problem problem{};
+  problem.l = n;
+  problem.y = ys.data();
   std::vector<svm_node *> pointersToXs;
-  for (int i = 0; i < n; i++) pointersToXs.push_back(xs[i].data());
+  for (auto &x : xs) pointersToXs.push_back(x.data());
   problem.x = pointersToXs.data();
-  svm_parameter parameter{};
-  parameter.svm_type = C_SVC;
-  parameter.kernel_type = LINEAR;
-  parameter.cache_size = cacheSize;
-  parameter.C = 1.0;
-  parameter.eps = svmEps;
+  svm_parameter parameter = trainingParameter();
+  parameter.nr_thread = arguments.size() > 3 ? stringToInteger(arguments[3]) : 0;
   const auto error_message = svm_check_parameter(&problem, &parameter);
   if (error_message) throw std::runtime_error(error_message);
-  std::cout << "Training model...";
+  const auto countRightTargets = [&](const std::vector<double> &targets) {
+    size_t right = 0;
+    for (int i = 0; i < n; i++) right += targets[i] == ys[i];
+    return right;
+  };
+  Timer timer;
+  std::vector<double> targets(n);
+  std::cout << "Cross validating with " << folds << " folds...";
+  std::cout.flush();
+  timer.start();
+  svm_cross_validation(&problem, &parameter, folds, targets.data());
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << " and got " << countRightTargets(targets) << "/" << n << " right." << '\n';
+  std::vector<double> parallelTargets(n);
+  std::cout << "Cross validating the folds in parallel...";
   std::cout.flush();
   timer.restart();
-  const auto model = svm_train(&problem, &parameter);
+  svm_cross_validation_parallel(&problem, &parameter, folds, parallelTargets.data());
   timer.stop();
-  std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
-  std::vector<std::vector<uint32_t>> results(10, std::vector<uint32_t>(10));
+  std::cout << " took " << timer.getElapsed().toSecondsString() << " and got " << countRightTargets(parallelTargets) << "/" << n << " right." << '\n';
+  if (parallelTargets != targets) throw std::runtime_error("The parallel cross validation predicted different labels.");
+  return 0;
+}
+
+int decisionModeFromString(const std::string &string) {
+  if (string == "max-wins") return MAX_WINS;
+  if (string == "early-exit") return EARLY_EXIT;
+  if (string == "dag") return DAG;
+  throw std::invalid_argument("Unknown decision mode " + string + ".");
+}
+
+size_t countRight(const ConfusionMatrix &results) {
+  size_t right = 0;
+  for (size_t r = 0; r < 10; r++) right += results[r][r];
+  return right;
+}
+
+// recognize eval [MODEL FILE] [LABELED FILE] (FIRST) (COUNT) (MODE)
+// The mode is a decision mode, max-wins, early-exit or dag, or quantized for the int8 QuantizedModel. Other modes than max-wins are also
+// compared to it.
+int eval(const std::vector<std::string> &arguments) {
+  const auto model = loadModel(arguments[0]);
+  std::vector<LabeledImage> images = readThresholdedImages(arguments[1], true);
+  const size_t first = arguments.size() > 2 ? stringToInteger(arguments[2]) : 0;
+  if (first > images.size()) throw std::runtime_error("Not enough labeled images.");
+  const size_t count = arguments.size() > 3 ? stringToInteger(arguments[3]) : images.size() - first;
+  if (first + count > images.size()) throw std::runtime_error("Not enough labeled images.");
+  const std::string mode = arguments.size() > 4 ? arguments[4] : "max-wins";
+  Timer timer;
   std::cout << "Evaluating model...";
   std::cout.flush();
-  timer.restart();
-  for (int i = 0; i < m; i++) {
-    auto nodes = edgeCountersFromImage(trainingImages[n + i].image);
-    const auto prediction = svm_predict(model, nodes.data());
-    results[trainingImages[n + i].label.value()][prediction]++;
+  timer.start();
+  ConfusionMatrix results;
+  std::string instructionSet;
+  if (mode == "quantized") {
+    const QuantizedModel quantizedModel(*model);
+    instructionSet = quantizedModel.getInstructionSet();
+    results = evaluate(quantizedModel, images.data() + first, count);
+  } else {
+    results = evaluate(CompiledModel(*model, decisionModeFromString(mode)), images.data() + first, count);
   }
   timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString();
+  if (!instructionSet.empty()) std::cout << " with " << instructionSet << " dot products";
+  std::cout << "." << '\n';
+  printResults(results);
+  if (mode != "max-wins") {
+    std::cout << "Evaluating with max-wins voting...";
+    std::cout.flush();
+    timer.restart();
+    const auto votingResults = evaluate(CompiledModel(*model, MAX_WINS), images.data() + first, count);
+    timer.stop();
+    std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+    const auto right = static_cast<double>(countRight(results));
+    const auto votingRight = static_cast<double>(countRight(votingResults));
+    std::cout << "Max-wins voting got " << votingRight << " of " << count << ", rate difference is " << toString((right - votingRight) / count, 4) << "." << '\n';
+  }
+  return 0;
+}
+
+// recognize compact [MODEL FILE] [TOLERANCE] [OUTPUT MODEL FILE] (LABELED FILE) (FIRST) (COUNT)
+// Merges the identical SVs of each class and drops the SVs whose coefficients are all below the tolerance. With a labeled file, both
+// models are evaluated on its images to show what the compaction cost.
+int compact(const std::vector<std::string> &arguments) {
+  const auto model = loadModel(arguments[0]);
+  const double tolerance = stringToDouble(arguments[1]);
+  Timer timer;
+  std::cout << "Compacting model...";
+  std::cout.flush();
+  timer.start();
+  const ModelPointer compactModel(svm_compact_model(model.get(), tolerance));
+  timer.stop();
   std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
-  size_t right = 0;
-  size_t wrong = 0;
-  for (size_t r = 0; r < 10; r++) {
-    const auto &row = results[r];
-    std::vector<std::pair<int, int>> predictions;
-    for (size_t i = 0; i < 10; i++) {
-      predictions.emplace_back(row[i], i);
-      if (i == r) {
-        right += row[i];
-      } else {
-        wrong += row[i];
+  std::cout << "Kept " << compactModel->l << " of " << model->l << " SVs." << '\n';
+  saveModel(arguments[2], compactModel.get());
+  if (arguments.size() < 4) return 0;
+  std::vector<LabeledImage> images = readThresholdedImages(arguments[3], true);
+  const size_t first = arguments.size() > 4 ? stringToInteger(arguments[4]) : 0;
+  if (first > images.size()) throw std::runtime_error("Not enough labeled images.");
+  const size_t count = arguments.size() > 5 ? stringToInteger(arguments[5]) : images.size() - first;
+  if (first + count > images.size()) throw std::runtime_error("Not enough labeled images.");
+  std::vector<size_t> rights;
+  for (const svm_model *evaluated : {model.get(), compactModel.get()}) {
+    std::cout << "Evaluating " << (evaluated == model.get() ? "the model" : "the compact model") << "...";
+    std::cout.flush();
+    timer.restart();
+    rights.push_back(countRight(evaluate(CompiledModel(*evaluated), images.data() + first, count)));
+    timer.stop();
+    std::cout << " took " << timer.getElapsed().toSecondsString() << "." << '\n';
+  }
+  std::cout << "Got " << rights[0] << " and " << rights[1] << " of " << count << ", rate difference is ";
+  std::cout << toString((static_cast<double>(rights[1]) - static_cast<double>(rights[0])) / count, 4) << "." << '\n';
+  return 0;
+}
+
+struct ImageBatch {
+  size_t sequence = 0;
+  std::vector<LabeledImage> images; // empty at the end of the input
+};
+
+struct FeatureBatch {
+  size_t sequence = 0;
+  std::vector<std::vector<svm_node>> nodes; // empty at the end of the input
+};
+
+struct PredictionBatch {
+  size_t sequence = 0;
+  std::vector<double> labels; // empty when a worker is done
+};
+
+void printQueueStatistics(const std::string &name, const QueueStatistics &statistics) {
+  std::cout << "  " << name << ": " << statistics.getPushes() << " batches, average depth " << toString(statistics.getAverageDepth(), 2) << ", maximum depth "
+            << statistics.getMaximumDepth() << ", producer stalled " << statistics.getPushStall().toSecondsString() << ", consumer stalled "
+            << statistics.getPopStall().toSecondsString() << "." << '\n';
+}
+
+// Predicts the images of a reader and writes the CSV rows in input order.
+// A parser thread, a featurizer thread (threshold and feature extraction), a pool of predictor workers and the calling thread, which writes
+// the results, are connected by bounded lock-free queues of batches, so reading, computing and writing overlap.
+// The queue statistics tell which stage limits throughput: the queue in front of it fills up and its producer stalls.
+class PredictionPipeline {
+  const CompiledModel &compiledModel;
+  size_t batchSize;
+  size_t workerCount = std::max<size_t>(1, std::thread::hardware_concurrency());
+  SpscQueue<ImageBatch> parsed{pipelineQueueCapacity};
+  MpmcQueue<FeatureBatch> featurized{pipelineQueueCapacity};
+  MpmcQueue<PredictionBatch> predicted{pipelineQueueCapacity};
+  // Batches the parser may be ahead of the writer: one per worker and as many waiting for them. This bounds pending in run(),
+  // which would otherwise keep growing with the input while one worker is stuck on an early batch.
+  size_t maxInFlight = 2 * workerCount;
+  std::atomic<size_t> written{0};
+  std::atomic<bool> failed{false};
+  std::mutex failureMutex;
+  std::exception_ptr failure;
+
+  // Keeps the first exception thrown by a stage and closes the queues, so the other stages stop instead of waiting for it.
+  void fail(std::exception_ptr exception) {
+    {
+      std::lock_guard<std::mutex> lock(failureMutex);
+      if (!failure) failure = exception;
+    }
+    failed = true;
+    parsed.close();
+    featurized.close();
+    predicted.close();
+  }
+
+ public:
+  PredictionPipeline(const CompiledModel &compiledModel, size_t batchSize) : compiledModel(compiledModel), batchSize(batchSize) {}
+
+  // Runs the pipeline once over the whole input and returns how many images there were.
+  // An exception thrown by any stage stops all of them and is rethrown here once they are joined.
+  size_t run(ImageReader &reader, std::ostream &output) {
+    std::vector<std::thread> threads;
+    threads.emplace_back([&]() {
+      try {
+        for (size_t sequence = 0;; sequence++) {
+          detail::retryUntil([&]() { return failed || sequence < written.load() + maxInFlight; });
+          if (failed) break;
+          ImageBatch batch{sequence, {}};
+          batch.images.reserve(batchSize);
+          const bool more = reader.read(batch.images, batchSize);
+          parsed.push(std::move(batch));
+          if (!more) break;
+        }
+      } catch (...) {
+        fail(std::current_exception());
+      }
+    });
+    threads.emplace_back([&]() {
+      try {
+        for (;;) {
+          ImageBatch batch = parsed.pop();
+          if (batch.images.empty() || failed) break;
+          FeatureBatch features{batch.sequence, {}};
+          features.nodes.reserve(batch.images.size());
+          for (auto &labeledImage : batch.images) {
+            labeledImage.image.applyThreshold();
+            features.nodes.push_back(edgeCountersFromImage(labeledImage.image));
+          }
+          featurized.push(std::move(features));
+        }
+        for (size_t w = 0; w < workerCount; w++) featurized.push(FeatureBatch{});
+      } catch (...) {
+        fail(std::current_exception());
       }
+    });
+    for (size_t w = 0; w < workerCount; w++) {
+      threads.emplace_back([&]() {
+        try {
+          CompiledModel::Workspace workspace(compiledModel);
+          for (;;) {
+            FeatureBatch features = featurized.pop();
+            if (features.nodes.empty() || failed) break;
+            PredictionBatch predictions{features.sequence, {}};
+            predictions.labels.reserve(features.nodes.size());
+            for (const auto &nodes : features.nodes) predictions.labels.push_back(compiledModel.predict(nodes.data(), workspace));
+            predicted.push(std::move(predictions));
+          }
+          predicted.push(PredictionBatch{});
+        } catch (...) {
+          fail(std::current_exception());
+        }
+      });
     }
-    std::sort(rbegin(predictions), rend(predictions));
-    for (int i = 0; i < 10; i++) {
-      if (predictions[i].first) {
-        std::cout << r << " >> " << predictions[i].second << ": " << padString(std::to_string(predictions[i].first), 10) << "\n";
+    // Batches finish out of order when there are several workers, so the ones that arrive early wait in pending.
+    std::map<size_t, std::vector<double>> pending;
+    size_t nextSequence = 0;
+    size_t id = 0;
+    try {
+      for (size_t finishedWorkers = 0; finishedWorkers < workerCount && !failed;) {
+        PredictionBatch predictions = predicted.pop();
+        if (predictions.labels.empty()) {
+          finishedWorkers++;
+          continue;
+        }
+        pending.emplace(predictions.sequence, std::move(predictions.labels));
+        for (auto it = pending.find(nextSequence); it != pending.end(); it = pending.find(++nextSequence)) {
+          for (const double label : it->second) output << ++id << ',' << label << '\n';
+          pending.erase(it);
+        }
+        if (!output) throw std::runtime_error("Could not write the predictions.");
+        written.store(nextSequence);
       }
+    } catch (...) {
+      fail(std::current_exception());
     }
+    for (auto &thread : threads) thread.join();
+    if (failure) std::rethrow_exception(failure);
+    return id;
   }
-  std::cout << "Got " << right << " of " << (right + wrong) << "." << ' ';
-  std::cout << "Rate is " << right / (double)(right + wrong) << "." << '\n';
+
+  void printStatistics() const {
+    std::cout << "Pipeline queues, predicting on " << workerCount << " threads:" << '\n';
+    printQueueStatistics("parse -> featurize", parsed.getStatistics());
+    printQueueStatistics("featurize -> predict", featurized.getStatistics());
+    printQueueStatistics("predict -> write", predicted.getStatistics());
+  }
+};
+
+// recognize predict [MODEL FILE] [UNLABELED FILE] [OUTPUT FILE] (BATCH SIZE)
+// Writes a CSV with the 1-based index and the predicted label of each image.
+// The input is streamed a batch at a time through the prediction pipeline, so memory stays bounded however many images the file has.
+int predict(const std::vector<std::string> &arguments) {
+  const auto model = loadModel(arguments[0]);
+  const CompiledModel compiledModel(*model);
+  const size_t batchSize = arguments.size() > 3 ? stringToInteger(arguments[3]) : defaultBatchSize;
+  if (batchSize == 0) throw std::invalid_argument("The batch size must be positive.");
+  ImageReader reader(arguments[1], false);
+  std::ofstream output(arguments[2]);
+  if (!output) throw std::runtime_error("Could not open " + arguments[2] + ".");
+  Timer timer;
+  std::cout << "Predicting...";
+  std::cout.flush();
+  timer.start();
+  output << "ImageId,Label" << '\n';
+  PredictionPipeline pipeline(compiledModel, batchSize);
+  const size_t count = pipeline.run(reader, output);
+  output.close();
+  if (!output) throw std::runtime_error("Could not write " + arguments[2] + ".");
+  timer.stop();
+  std::cout << " took " << timer.getElapsed().toSecondsString() << " for " << count << " images." << '\n';
+  pipeline.printStatistics();
   return 0;
 }
+
+std::atomic<bool> stopRequested{false};
+
+void requestStop(int) { stopRequested = true; }
+
+// recognize serve [MODEL FILE] [SOCKET FILE] (MAX BATCH) (MAX WAIT MICROSECONDS)
+// Serves predictions over a Unix domain socket until interrupted, see PredictionServer for the protocol.
+// The model file is watched and a new model is swapped in without interrupting the service when it is replaced.
+int serve(const std::vector<std::string> &arguments) {
+  ModelHolder models(loadModel(arguments[0]));
+  const size_t maxBatch = arguments.size() > 2 ? stringToInteger(arguments[2]) : defaultServeBatch;
+  const auto maxWait = Duration{(arguments.size() > 3 ? stringToInteger(arguments[3]) : defaultServeWaitMicroseconds) * U64{1000}};
+  PredictionServer server(models, maxBatch, maxWait);
+  models.watch(arguments[0], Duration::fromSeconds(modelWatchInterval), [&](const svm_model &model) { server.checkReplacement(model); });
+  std::signal(SIGINT, requestStop);
+  std::signal(SIGTERM, requestStop);
+  std::cout << "Serving on " << arguments[1] << " with batches of up to " << maxBatch << " images and " << maxWait.getNanoseconds() / 1000 << " microseconds."
+            << '\n';
+  server.run(arguments[1], stopRequested);
+  models.stopWatching();
+  const auto images = server.getImageCount();
+  const auto batches = server.getBatchCount();
+  std::cout << "Served " << images << " images in " << batches << " batches";
+  if (batches != 0) std::cout << ", " << toString(images / static_cast<double>(batches), 2) << " images per batch";
+  std::cout << ", " << models.getGeneration() << " model replacements." << '\n';
+  return 0;
+}
+
+// recognize query [SOCKET FILE] [UNLABELED FILE] [OUTPUT FILE] (CONNECTIONS)
+// Sends every image to a server over several concurrent connections, writes the predictions like predict and reports the latencies.
+int query(const std::vector<std::string> &arguments) {
+  const std::vector<LabeledImage> images = readImagesFromFile(arguments[1], false);
+  const size_t connectionCount = arguments.size() > 3 ? stringToInteger(arguments[3]) : 1;
+  if (connectionCount == 0) throw std::invalid_argument("There must be at least one connection.");
+  std::vector<int32_t> labels(images.size());
+  std::vector<U64> latencies(images.size());
+  std::vector<std::string> errors(connectionCount);
+  Timer timer;
+  std::cout << "Querying...";
+  std::cout.flush();
+  timer.start();
+  std::vector<std::thread> threads;
+  for (size_t c = 0; c < connectionCount; c++) {
+    threads.emplace_back([&, c]() {
+      try {
+        const FileDescriptor socket = connectToUnixSocket(arguments[0]);
+        uint32_t decisionValueCount;
+        if (!readFully(socket.get(), &decisionValueCount, sizeof(decisionValueCount))) throw std::runtime_error("The server closed the connection.");
+        std::vector<unsigned char> reply(sizeof(int32_t) + decisionValueCount * sizeof(double));
+        for (size_t i = c * images.size() / connectionCount; i < (c + 1) * images.size() / connectionCount; i++) {
+          Clock clock;
+          writeFully(socket.get(), images[i].image.data.data(), imageSize);
+          if (!readFully(socket.get(), reply.data(), reply.size())) throw std::runtime_error("The server closed the connection.");
+          latencies[i] = clock.getElapsed().getNanoseconds();
+          std::memcpy(&labels[i], reply.data(), sizeof(int32_t));
+        }
+      } catch (const std::exception &exception) {
+        errors[c] = exception.what();
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  timer.stop();
+  for (const auto &error : errors) {
+    if (!error.empty()) throw std::runtime_error(error);
+  }
+  std::cout << " took " << timer.getElapsed().toSecondsString() << " for " << images.size() << " images." << '\n';
+  std::ofstream output(arguments[2]);
+  if (!output) throw std::runtime_error("Could not open " + arguments[2] + ".");
+  output << "ImageId,Label" << '\n';
+  for (size_t i = 0; i < labels.size(); i++) output << i + 1 << ',' << labels[i] << '\n';
+  output.close();
+  if (!output) throw std::runtime_error("Could not write " + arguments[2] + ".");
+  if (!latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double p) { return toString(latencies[static_cast<size_t>(p * (latencies.size() - 1))] / 1000.0, 1); };
+    std::cout << "Throughput is " << toString(images.size() / timer.getElapsed().toSeconds(), 0) << " images per second. ";
+    std::cout << "Latency p50 " << percentile(0.5) << ", p99 " << percentile(0.99) << ", max " << percentile(1.0) << " microseconds." << '\n';
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const std::string command = argc >= 2 ? argv[1] : "";
+  const std::vector<std::string> arguments(argv + std::min(argc, 2), argv + argc);
+  if (command == "train" && arguments.size() >= 3) return train(arguments);
+  if (command == "cv" && arguments.size() >= 3) return crossValidate(arguments);
+  if (command == "eval" && arguments.size() >= 2) return eval(arguments);
+  if (command == "compact" && arguments.size() >= 3) return compact(arguments);
+  if (command == "predict" && arguments.size() >= 3) return predict(arguments);
+  if (command == "serve" && arguments.size() >= 2) return serve(arguments);
+  if (command == "query" && arguments.size() >= 3) return query(arguments);
+  std::cout << "Usage: " << argv[0] << " train [TRAINING FILE] [N] [MODEL FILE] (SV BUDGET) (PAIR SV BUDGET) (COLLAPSE DUPLICATES)" << '\n';
+  std::cout << "       " << argv[0] << " cv [TRAINING FILE] [N] [FOLDS] (THREADS)" << '\n';
+  std::cout << "       " << argv[0] << " eval [MODEL FILE] [LABELED FILE] (FIRST) (COUNT) (MODE)" << '\n';
+  std::cout << "       " << argv[0] << " compact [MODEL FILE] [TOLERANCE] [OUTPUT MODEL FILE] (LABELED FILE) (FIRST) (COUNT)" << '\n';
+  std::cout << "       " << argv[0] << " predict [MODEL FILE] [UNLABELED FILE] [OUTPUT FILE] (BATCH SIZE)" << '\n';
+  std::cout << "       " << argv[0] << " serve [MODEL FILE] [SOCKET FILE] (MAX BATCH) (MAX WAIT MICROSECONDS)" << '\n';
+  std::cout << "       " << argv[0] << " query [SOCKET FILE] [UNLABELED FILE] [OUTPUT FILE] (CONNECTIONS)" << '\n';
+  std::cout << "Models whose file name ends in .bin are written in the binary format." << '\n';
+  return 1;
+}
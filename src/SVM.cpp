@@ -1,13 +1,23 @@
 #include "SVM.h"
+#include "KernelFunction.hpp"
 #include <ctype.h>
 #include <float.h>
 #include <limits.h>
-#include <locale.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <charconv>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 int libsvm_version = LIBSVM_VERSION;
 typedef float Qfloat;
 typedef signed char schar;
@@ -34,15 +44,6 @@ static inline void clone(T *&dst, S *src, int n) {
   dst = new T[n];
   memcpy((void *)dst, (void *)src, sizeof(T) * n);
 }
-static inline double powi(double base, int times) {
-  double tmp = base, ret = 1.0;
-
-  for (int t = times; t > 0; t /= 2) {
-    if (t % 2 == 1) ret *= tmp;
-    tmp = tmp * tmp;
-  }
-  return ret;
-}
 #define INF HUGE_VAL
 #define TAU 1e-12
 #define Malloc(type, n) (type *)malloc((n) * sizeof(type))
@@ -66,6 +67,76 @@ static void info(const char *fmt,...)
 static void info(const char *, ...) {}
 #endif
 
+//
+// Random number generation
+//
+// xoshiro256** seeded through splitmix64, see https://prng.di.unimi.it
+// every routine that shuffles owns its engine, so results only depend on
+// svm_parameter::seed and not on thread scheduling or the global rand() state
+//
+class Random {
+ public:
+  explicit Random(uint64_t seed) {
+    for (int i = 0; i < 4; i++) s[i] = splitmix64(seed);
+  }
+
+  uint64_t next() {
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  // uniform in [0,n)
+  int next_int(int n) { return (int)(((next() >> 32) * (uint64_t)n) >> 32); }
+
+  // seed of an independent stream, e.g. for the i-th fold or pairwise problem
+  static uint64_t derive_seed(uint64_t seed, uint64_t stream) {
+    uint64_t state = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+    return splitmix64(state);
+  }
+
+ private:
+  uint64_t s[4];
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+  static uint64_t splitmix64(uint64_t &state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+};
+
+// Number of threads to use for n independent tasks, nr_thread = 0 meaning one per hardware thread
+static int svm_thread_count(int nr_thread, int n) {
+  if (nr_thread <= 0) nr_thread = max(1, (int)std::thread::hardware_concurrency());
+  return max(1, min(nr_thread, n));
+}
+
+// Run task(i) for every i in [0,n) on nr_thread threads, handing out indices in increasing order
+template <class F>
+static void parallel_for(int n, int nr_thread, F task) {
+  if (nr_thread <= 1) {
+    for (int i = 0; i < n; i++) task(i);
+    return;
+  }
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i = next++; i < n; i = next++) task(i);
+  };
+  std::thread *threads = new std::thread[nr_thread - 1];
+  for (int t = 0; t < nr_thread - 1; t++) threads[t] = std::thread(worker);
+  worker();
+  for (int t = 0; t < nr_thread - 1; t++) threads[t].join();
+  delete[] threads;
+}
+
 //
 // Kernel Cache
 //
@@ -194,18 +265,34 @@ class QMatrix {
   virtual ~QMatrix() {}
 };
 
+//
+// Compact rows
+//
+// Kernel packs the rows of the problem with 16-bit indices and the values in a separate array, one row after another,
+// narrowing the values to bytes when all of them are integers in [0,255]: a nonzero then takes 3 bytes instead of the 16 of an svm_node
+// with double values, and the dot products of get_Q stream that much less memory
+//
+enum { SPARSE_NODES, COMPACT_BYTES, COMPACT_VALUES }; /* representation of the rows of a Kernel */
+
+struct compact_row {
+  int offset; /* of the first nonzero of the row in the index and value arrays */
+  int length;
+};
+
 class Kernel : public QMatrix {
  public:
   Kernel(int l, svm_node *const *x, const svm_parameter &param);
   virtual ~Kernel();
 
   static double k_function(const svm_node *x, const svm_node *y, const svm_parameter &param);
+  static double dot(const svm_node *px, const svm_node *py);
   virtual Qfloat *get_Q(int column, int len) const = 0;
   virtual double *get_QD() const = 0;
   virtual void swap_index(int i, int j) const  // no so const...
   {
     swap(x[i], x[j]);
     if (x_square) swap(x_square[i], x_square[j]);
+    if (rows) swap(rows[i], rows[j]);
   }
 
  protected:
@@ -215,18 +302,116 @@ class Kernel : public QMatrix {
   const svm_node **x;
   double *x_square;
 
+  int representation;
+  compact_row *rows;        // NULL for SPARSE_NODES
+  uint16_t *compact_index;
+  uint8_t *compact_byte;    // values for COMPACT_BYTES
+  svm_value *compact_value; // values for COMPACT_VALUES
+
+  void compact(int l);
+
+  template <class Value>
+  double compact_dot(int i, int j) const {
+    const uint16_t *pi = compact_index + rows[i].offset;
+    const uint16_t *pj = compact_index + rows[j].offset;
+    const uint16_t *end_i = pi + rows[i].length;
+    const uint16_t *end_j = pj + rows[j].length;
+    const Value *vi = compact_values<Value>() + rows[i].offset;
+    const Value *vj = compact_values<Value>() + rows[j].offset;
+    double sum = 0;
+    while (pi != end_i && pj != end_j) {
+      if (*pi == *pj) {
+        sum += (double)*vi * *vj;
+        ++pi, ++vi;
+        ++pj, ++vj;
+      } else if (*pi > *pj)
+        ++pj, ++vj;
+      else
+        ++pi, ++vi;
+    }
+    return sum;
+  }
+
+  template <class Value>
+  const Value *compact_values() const {
+    if constexpr (std::is_same<Value, uint8_t>::value)
+      return compact_byte;
+    else
+      return compact_value;
+  }
+
+  // dot(x[i],x[j]) with the rows as Value: svm_node for the rows of the problem, uint8_t or svm_value for the compact ones
+  template <class Value>
+  double row_dot(int i, int j) const {
+    if constexpr (std::is_same<Value, svm_node>::value)
+      return dot(x[i], x[j]);
+    else
+      return compact_dot<Value>(i, j);
+  }
+
   // svm_parameter
   const int kernel_type;
   const int degree;
   const double gamma;
   const double coef0;
 
-  static double dot(const svm_node *px, const svm_node *py);
   double kernel_linear(int i, int j) const { return dot(x[i], x[j]); }
-  double kernel_poly(int i, int j) const { return powi(gamma * dot(x[i], x[j]) + coef0, degree); }
+  double kernel_poly(int i, int j) const { return kernels::powi(gamma * dot(x[i], x[j]) + coef0, degree); }
   double kernel_rbf(int i, int j) const { return exp(-gamma * (x_square[i] + x_square[j] - 2 * dot(x[i], x[j]))); }
   double kernel_sigmoid(int i, int j) const { return tanh(gamma * dot(x[i], x[j]) + coef0); }
   double kernel_precomputed(int i, int j) const { return x[i][(int)(x[j][0].value)].value; }
+
+  template <int KERNEL_TYPE, class Value>
+  double kernel(int i, int j) const {
+    if constexpr (KERNEL_TYPE == PRECOMPUTED)
+      return kernel_precomputed(i, j);
+    else
+      return kernels::fromDot<KERNEL_TYPE>(row_dot<Value>(i, j), KERNEL_TYPE == RBF ? x_square[i] + x_square[j] : 0, gamma, coef0, degree);
+  }
+
+  template <int KERNEL_TYPE, class Value, class Scale>
+  void fill_column_of(int i, int start, int len, Qfloat *data, Scale scale) const {
+    for (int j = start; j < len; j++) data[j] = (Qfloat)(scale(j) * kernel<KERNEL_TYPE, Value>(i, j));
+  }
+
+  template <class Value, class Scale>
+  void fill_column_as(int i, int start, int len, Qfloat *data, Scale scale) const {
+    switch (kernel_type) {
+      case LINEAR:
+        fill_column_of<LINEAR, Value>(i, start, len, data, scale);
+        break;
+      case POLY:
+        fill_column_of<POLY, Value>(i, start, len, data, scale);
+        break;
+      case RBF:
+        fill_column_of<RBF, Value>(i, start, len, data, scale);
+        break;
+      case SIGMOID:
+        fill_column_of<SIGMOID, Value>(i, start, len, data, scale);
+        break;
+      case PRECOMPUTED:
+        fill_column_of<PRECOMPUTED, Value>(i, start, len, data, scale);
+        break;
+    }
+  }
+
+ protected:
+  // data[j] = scale(j) * K(i,j) for j in [start,len)
+  // the kernel and the row representation are chosen once per column and the loop is instantiated for them,
+  // so the kernel is inlined instead of called through kernel_function
+  template <class Scale>
+  void fill_column(int i, int start, int len, Qfloat *data, Scale scale) const {
+    switch (representation) {
+      case COMPACT_BYTES:
+        fill_column_as<uint8_t>(i, start, len, data, scale);
+        break;
+      case COMPACT_VALUES:
+        fill_column_as<svm_value>(i, start, len, data, scale);
+        break;
+      default:
+        fill_column_as<svm_node>(i, start, len, data, scale);
+    }
+  }
 };
 
 Kernel::Kernel(int l, svm_node *const *x_, const svm_parameter &param) : kernel_type(param.kernel_type), degree(param.degree), gamma(param.gamma), coef0(param.coef0) {
@@ -255,18 +440,62 @@ Kernel::Kernel(int l, svm_node *const *x_, const svm_parameter &param) : kernel_
     for (int i = 0; i < l; i++) x_square[i] = dot(x[i], x[i]);
   } else
     x_square = 0;
+
+  representation = SPARSE_NODES;
+  rows = NULL;
+  compact_index = NULL;
+  compact_byte = NULL;
+  compact_value = NULL;
+  if (kernel_type != PRECOMPUTED) compact(l);
+}
+
+// Packs the rows into compact rows, unless an index does not fit in 16 bits
+void Kernel::compact(int l) {
+  long int total = 0;
+  bool bytes = true;
+  for (int i = 0; i < l; i++)
+    for (const svm_node *p = x[i]; p->index != -1; ++p) {
+      if (p->index < 0 || p->index > UINT16_MAX) return;
+      if (!(p->value >= 0 && p->value <= UINT8_MAX && p->value == (int)p->value)) bytes = false;
+      ++total;
+    }
+  if (total > INT_MAX) return;
+
+  rows = new compact_row[l];
+  compact_index = new uint16_t[total];
+  if (bytes)
+    compact_byte = new uint8_t[total];
+  else
+    compact_value = new svm_value[total];
+  int offset = 0;
+  for (int i = 0; i < l; i++) {
+    rows[i].offset = offset;
+    for (const svm_node *p = x[i]; p->index != -1; ++p, ++offset) {
+      compact_index[offset] = (uint16_t)p->index;
+      if (bytes)
+        compact_byte[offset] = (uint8_t)p->value;
+      else
+        compact_value[offset] = p->value;
+    }
+    rows[i].length = offset - rows[i].offset;
+  }
+  representation = bytes ? COMPACT_BYTES : COMPACT_VALUES;
 }
 
 Kernel::~Kernel() {
   delete[] x;
   delete[] x_square;
+  delete[] rows;
+  delete[] compact_index;
+  delete[] compact_byte;
+  delete[] compact_value;
 }
 
 double Kernel::dot(const svm_node *px, const svm_node *py) {
   double sum = 0;
   while (px->index != -1 && py->index != -1) {
     if (px->index == py->index) {
-      sum += px->value * py->value;
+      sum += (double)px->value * py->value;
       ++px;
       ++py;
     } else {
@@ -284,33 +513,33 @@ double Kernel::k_function(const svm_node *x, const svm_node *y, const svm_parame
     case LINEAR:
       return dot(x, y);
     case POLY:
-      return powi(param.gamma * dot(x, y) + param.coef0, param.degree);
+      return kernels::powi(param.gamma * dot(x, y) + param.coef0, param.degree);
     case RBF: {
       double sum = 0;
       while (x->index != -1 && y->index != -1) {
         if (x->index == y->index) {
-          double d = x->value - y->value;
+          double d = (double)x->value - y->value;
           sum += d * d;
           ++x;
           ++y;
         } else {
           if (x->index > y->index) {
-            sum += y->value * y->value;
+            sum += (double)y->value * y->value;
             ++y;
           } else {
-            sum += x->value * x->value;
+            sum += (double)x->value * x->value;
             ++x;
           }
         }
       }
 
       while (x->index != -1) {
-        sum += x->value * x->value;
+        sum += (double)x->value * x->value;
         ++x;
       }
 
       while (y->index != -1) {
-        sum += y->value * y->value;
+        sum += (double)y->value * y->value;
         ++y;
       }
 
@@ -332,12 +561,12 @@ double Kernel::k_function(const svm_node *x, const svm_node *y, const svm_parame
 //
 //		y^T \alpha = \delta
 //		y_i = +1 or -1
-//		0 <= alpha_i <= Cp for y_i = 1
-//		0 <= alpha_i <= Cn for y_i = -1
+//		0 <= alpha_i <= Cp W_i for y_i = 1
+//		0 <= alpha_i <= Cn W_i for y_i = -1
 //
 // Given:
 //
-//	Q, p, y, Cp, Cn, and an initial feasible point \alpha
+//	Q, p, y, Cp, Cn, the instance weights W (all 1 if NULL), and an initial feasible point \alpha
 //	l is the size of vectors and matrices
 //	eps is the stopping tolerance
 //
@@ -356,7 +585,7 @@ class Solver {
     double r;  // for Solver_NU
   };
 
-  void Solve(int l, const QMatrix &Q, const double *p_, const schar *y_, double *alpha_, double Cp, double Cn, double eps, SolutionInfo *si, int shrinking);
+  void Solve(int l, const QMatrix &Q, const double *p_, const schar *y_, double *alpha_, double Cp, double Cn, const double *W, double eps, SolutionInfo *si, int shrinking);
 
  protected:
   int active_size;
@@ -368,14 +597,14 @@ class Solver {
   const QMatrix *Q;
   const double *QD;
   double eps;
-  double Cp, Cn;
+  double *C;  // upper bound of each alpha
   double *p;
   int *active_set;
   double *G_bar;  // gradient, if we treat free variables as 0
   int l;
   bool unshrink;  // XXX
 
-  double get_C(int i) { return (y[i] > 0) ? Cp : Cn; }
+  double get_C(int i) { return C[i]; }
   void update_alpha_status(int i) {
     if (alpha[i] >= get_C(i))
       alpha_status[i] = UPPER_BOUND;
@@ -403,6 +632,7 @@ void Solver::swap_index(int i, int j) {
   swap(G[i], G[j]);
   swap(alpha_status[i], alpha_status[j]);
   swap(alpha[i], alpha[j]);
+  swap(C[i], C[j]);
   swap(p[i], p[j]);
   swap(active_set[i], active_set[j]);
   swap(G_bar[i], G_bar[j]);
@@ -439,15 +669,15 @@ void Solver::reconstruct_gradient() {
   }
 }
 
-void Solver::Solve(int l, const QMatrix &Q, const double *p_, const schar *y_, double *alpha_, double Cp, double Cn, double eps, SolutionInfo *si, int shrinking) {
+void Solver::Solve(int l, const QMatrix &Q, const double *p_, const schar *y_, double *alpha_, double Cp, double Cn, const double *W, double eps, SolutionInfo *si, int shrinking) {
   this->l = l;
   this->Q = &Q;
   QD = Q.get_QD();
   clone(p, p_, l);
   clone(y, y_, l);
   clone(alpha, alpha_, l);
-  this->Cp = Cp;
-  this->Cn = Cn;
+  C = new double[l];
+  for (int i = 0; i < l; i++) C[i] = (y[i] > 0 ? Cp : Cn) * (W != NULL ? W[i] : 1);
   this->eps = eps;
   unshrink = false;
 
@@ -666,6 +896,7 @@ void Solver::Solve(int l, const QMatrix &Q, const double *p_, const schar *y_, d
   delete[] p;
   delete[] y;
   delete[] alpha;
+  delete[] C;
   delete[] alpha_status;
   delete[] active_set;
   delete[] G;
@@ -853,7 +1084,7 @@ class Solver_NU : public Solver {
   Solver_NU() {}
   void Solve(int l, const QMatrix &Q, const double *p, const schar *y, double *alpha, double Cp, double Cn, double eps, SolutionInfo *si, int shrinking) {
     this->si = si;
-    Solver::Solve(l, Q, p, y, alpha, Cp, Cn, eps, si, shrinking);
+    Solver::Solve(l, Q, p, y, alpha, Cp, Cn, NULL, eps, si, shrinking);
   }
 
  private:
@@ -1071,9 +1302,9 @@ class SVC_Q : public Kernel {
 
   Qfloat *get_Q(int i, int len) const {
     Qfloat *data;
-    int start, j;
+    int start;
     if ((start = cache->get_data(i, &data, len)) < len) {
-      for (j = start; j < len; j++) data[j] = (Qfloat)(y[i] * y[j] * (this->*kernel_function)(i, j));
+      fill_column(i, start, len, data, [this, i](int j) { return y[i] * y[j]; });
     }
     return data;
   }
@@ -1109,9 +1340,9 @@ class ONE_CLASS_Q : public Kernel {
 
   Qfloat *get_Q(int i, int len) const {
     Qfloat *data;
-    int start, j;
+    int start;
     if ((start = cache->get_data(i, &data, len)) < len) {
-      for (j = start; j < len; j++) data[j] = (Qfloat)(this->*kernel_function)(i, j);
+      fill_column(i, start, len, data, [](int) { return 1; });
     }
     return data;
   }
@@ -1165,7 +1396,7 @@ class SVR_Q : public Kernel {
     Qfloat *data;
     int j, real_i = index[i];
     if (cache->get_data(real_i, &data, l) < l) {
-      for (j = 0; j < l; j++) data[j] = (Qfloat)(this->*kernel_function)(real_i, j);
+      fill_column(real_i, 0, l, data, [](int) { return 1; });
     }
 
     // reorder and copy
@@ -1217,12 +1448,16 @@ static void solve_c_svc(const svm_problem *prob, const svm_parameter *param, dou
   }
 
   Solver s;
-  s.Solve(l, SVC_Q(*prob, *param, y), minus_ones, y, alpha, Cp, Cn, param->eps, si, param->shrinking);
+  s.Solve(l, SVC_Q(*prob, *param, y), minus_ones, y, alpha, Cp, Cn, prob->W, param->eps, si, param->shrinking);
 
   double sum_alpha = 0;
-  for (i = 0; i < l; i++) sum_alpha += alpha[i];
+  double sum_weight = 0;
+  for (i = 0; i < l; i++) {
+    sum_alpha += alpha[i];
+    sum_weight += prob->W != NULL ? prob->W[i] : 1;
+  }
 
-  if (Cp == Cn) info("nu = %f\n", sum_alpha / (Cp * prob->l));
+  if (Cp == Cn) info("nu = %f\n", sum_alpha / (Cp * sum_weight));
 
   for (i = 0; i < l; i++) alpha[i] *= y[i];
 
@@ -1294,7 +1529,7 @@ static void solve_one_class(const svm_problem *prob, const svm_parameter *param,
   }
 
   Solver s;
-  s.Solve(l, ONE_CLASS_Q(*prob, *param), zeros, ones, alpha, 1.0, 1.0, param->eps, si, param->shrinking);
+  s.Solve(l, ONE_CLASS_Q(*prob, *param), zeros, ones, alpha, 1.0, 1.0, NULL, param->eps, si, param->shrinking);
 
   delete[] zeros;
   delete[] ones;
@@ -1318,7 +1553,7 @@ static void solve_epsilon_svr(const svm_problem *prob, const svm_parameter *para
   }
 
   Solver s;
-  s.Solve(2 * l, SVR_Q(*prob, *param), linear_term, y, alpha2, param->C, param->C, param->eps, si, param->shrinking);
+  s.Solve(2 * l, SVR_Q(*prob, *param), linear_term, y, alpha2, param->C, param->C, NULL, param->eps, si, param->shrinking);
 
   double sum_alpha = 0;
   for (i = 0; i < l; i++) {
@@ -1364,6 +1599,115 @@ static void solve_nu_svr(const svm_problem *prob, const svm_parameter *param, do
   delete[] y;
 }
 
+//
+// SV budgets
+//
+// A budget is enforced by keeping that many SVs, chosen at random within each class, and solving again on their training data alone,
+// which leaves at most that many SVs: the points left out get alpha = 0, as if they had never been in the problem
+// The SVs with the largest |alpha| would be the obvious choice, but they are the hardest points of the problem,
+// and solving on them alone generalizes much worse than solving on a random sample of all SVs
+//
+
+// Sets kept[i] for budget of the indices with group[i] >= 0, or for all of them if there are not more, and returns how many
+// The choice is random within each of the nr_group groups (classes), and every group with candidates keeps at least one of them
+// and otherwise a share of the budget in proportion to its candidates, so a budget can thin out a class but never remove it
+static int svm_keep_random(const int *group, int nr_group, int l, int budget, bool *kept, Random &rng) {
+  int *count = Malloc(int, nr_group);
+  int *quota = Malloc(int, nr_group);
+  int *start = Malloc(int, nr_group + 1);
+  int *index = Malloc(int, l);
+  int g, i;
+  for (g = 0; g < nr_group; g++) count[g] = 0;
+  for (i = 0; i < l; i++) {
+    kept[i] = false;
+    if (group[i] >= 0) ++count[group[i]];
+  }
+  int n = 0, nr_nonempty = 0;
+  for (g = 0; g < nr_group; g++) {
+    n += count[g];
+    quota[g] = min(count[g], 1);
+    nr_nonempty += quota[g];
+  }
+  budget = min(budget, n);
+  int left = max(budget - nr_nonempty, 0);
+  int assigned = nr_nonempty;
+  for (g = 0; g < nr_group && n > nr_nonempty; g++) {
+    int extra = (int)((int64_t)left * (count[g] - quota[g]) / (n - nr_nonempty));
+    quota[g] += extra;
+    assigned += extra;
+  }
+  // the rounded down shares leave fewer than nr_group places, which go to the groups in turn
+  for (g = 0; assigned < budget; g = (g + 1) % nr_group)
+    if (quota[g] < count[g]) {
+      ++quota[g];
+      ++assigned;
+    }
+
+  start[0] = 0;
+  for (g = 0; g < nr_group; g++) start[g + 1] = start[g] + count[g];
+  for (i = 0; i < l; i++)
+    if (group[i] >= 0) index[start[group[i]]++] = i;
+  for (g = 0; g < nr_group; g++) start[g] -= count[g];
+  for (g = 0; g < nr_group; g++) {
+    int *candidates = index + start[g];
+    for (i = 0; i < quota[g]; i++) {
+      int j = i + rng.next_int(count[g] - i);
+      swap(candidates[i], candidates[j]);
+      kept[candidates[i]] = true;
+    }
+  }
+  free(index);
+  free(start);
+  free(quota);
+  free(count);
+  return assigned;
+}
+
+// Solves the binary problem of solve_c_svc again on param->pair_sv_budget of its SVs, if it has more
+static void svm_apply_pair_sv_budget(const svm_problem *prob, const svm_parameter *param, double *alpha, Solver::SolutionInfo *si, double Cp, double Cn) {
+  int l = prob->l;
+  int budget = param->pair_sv_budget;
+  int nSV = 0;
+  int *group = Malloc(int, l);
+  for (int i = 0; i < l; i++) {
+    group[i] = fabs(alpha[i]) > 0 ? (prob->y[i] > 0 ? 0 : 1) : -1;
+    if (group[i] >= 0) ++nSV;
+  }
+  if (nSV <= budget) {
+    free(group);
+    return;
+  }
+  info("nSV = %d, solving again on %d of them\n", nSV, budget);
+  bool *kept = Malloc(bool, l);
+  Random rng(param->seed);
+  int nr_kept = svm_keep_random(group, 2, l, budget, kept, rng);
+  svm_problem sub_prob;
+  sub_prob.l = nr_kept;
+  sub_prob.x = Malloc(svm_node *, nr_kept);
+  sub_prob.y = Malloc(double, nr_kept);
+  sub_prob.W = prob->W != NULL ? Malloc(double, nr_kept) : NULL;
+  int *index = Malloc(int, nr_kept);
+  int k = 0;
+  for (int i = 0; i < l; i++)
+    if (kept[i]) {
+      sub_prob.x[k] = prob->x[i];
+      sub_prob.y[k] = prob->y[i];
+      if (sub_prob.W != NULL) sub_prob.W[k] = prob->W[i];
+      index[k++] = i;
+    }
+  double *sub_alpha = Malloc(double, nr_kept);
+  solve_c_svc(&sub_prob, param, sub_alpha, si, Cp, Cn);
+  for (int i = 0; i < l; i++) alpha[i] = 0;
+  for (k = 0; k < nr_kept; k++) alpha[index[k]] = sub_alpha[k];
+  free(sub_alpha);
+  free(index);
+  free(sub_prob.x);
+  free(sub_prob.y);
+  free(sub_prob.W);
+  free(kept);
+  free(group);
+}
+
 //
 // decision_function
 //
@@ -1378,6 +1722,7 @@ static decision_function svm_train_one(const svm_problem *prob, const svm_parame
   switch (param->svm_type) {
     case C_SVC:
       solve_c_svc(prob, param, alpha, &si, Cp, Cn);
+      if (param->pair_sv_budget > 0) svm_apply_pair_sv_budget(prob, param, alpha, &si, Cp, Cn);
       break;
     case NU_SVC:
       solve_nu_svc(prob, param, alpha, &si);
@@ -1402,10 +1747,11 @@ static decision_function svm_train_one(const svm_problem *prob, const svm_parame
   for (int i = 0; i < prob->l; i++) {
     if (fabs(alpha[i]) > 0) {
       ++nSV;
+      double weight = prob->W != NULL ? prob->W[i] : 1;
       if (prob->y[i] > 0) {
-        if (fabs(alpha[i]) >= si.upper_bound_p) ++nBSV;
+        if (fabs(alpha[i]) >= si.upper_bound_p * weight) ++nBSV;
       } else {
-        if (fabs(alpha[i]) >= si.upper_bound_n) ++nBSV;
+        if (fabs(alpha[i]) >= si.upper_bound_n * weight) ++nBSV;
       }
     }
   }
@@ -1418,6 +1764,17 @@ static decision_function svm_train_one(const svm_problem *prob, const svm_parame
   return f;
 }
 
+// Objective of the sigmoid fit at (A,B), written branch-free with a single exp per value
+// log(1+exp(-fApB)) for fApB >= 0 and (-fApB)+log(1+exp(fApB)) otherwise share exp(-|fApB|)
+static double sigmoid_objective(int l, const double *dec_values, const double *t, double A, double B) {
+  double f = 0.0;
+  for (int i = 0; i < l; i++) {
+    double fApB = dec_values[i] * A + B;
+    f += t[i] * fApB + max(-fApB, 0.0) + log(1 + exp(-fabs(fApB)));
+  }
+  return f;
+}
+
 // Platt's binary SVM Probablistic Output: an improvement from Lin et al.
 static void sigmoid_train(int l, const double *dec_values, const double *labels, double &A, double &B) {
   double prior1 = 0, prior0 = 0;
@@ -1436,26 +1793,17 @@ static void sigmoid_train(int l, const double *dec_values, const double *labels,
   double hiTarget = (prior1 + 1.0) / (prior1 + 2.0);
   double loTarget = 1 / (prior0 + 2.0);
   double *t = Malloc(double, l);
-  double fApB, p, q, h11, h22, h21, g1, g2, det, dA, dB, gd, stepsize;
-  double newA, newB, newf, d1, d2;
+  double h11, h22, h21, g1, g2, det, dA, dB, gd, stepsize;
+  double newA, newB, newf;
   int iter;
 
   // Initial Point and Initial Fun Value
   A = 0.0;
   B = log((prior0 + 1.0) / (prior1 + 1.0));
-  double fval = 0.0;
 
-  for (i = 0; i < l; i++) {
-    if (labels[i] > 0)
-      t[i] = hiTarget;
-    else
-      t[i] = loTarget;
-    fApB = dec_values[i] * A + B;
-    if (fApB >= 0)
-      fval += t[i] * fApB + log(1 + exp(-fApB));
-    else
-      fval += (t[i] - 1) * fApB + log(1 + exp(fApB));
-  }
+  for (i = 0; i < l; i++) t[i] = labels[i] > 0 ? hiTarget : loTarget;
+  double fval = sigmoid_objective(l, dec_values, t, A, B);
+
   for (iter = 0; iter < max_iter; iter++) {
     // Update Gradient and Hessian (use H' = H + sigma I)
     h11 = sigma;  // numerically ensures strict PD
@@ -1464,19 +1812,16 @@ static void sigmoid_train(int l, const double *dec_values, const double *labels,
     g1 = 0.0;
     g2 = 0.0;
     for (i = 0; i < l; i++) {
-      fApB = dec_values[i] * A + B;
-      if (fApB >= 0) {
-        p = exp(-fApB) / (1.0 + exp(-fApB));
-        q = 1.0 / (1.0 + exp(-fApB));
-      } else {
-        p = 1.0 / (1.0 + exp(fApB));
-        q = exp(fApB) / (1.0 + exp(fApB));
-      }
-      d2 = p * q;
+      // with e = exp(-|fApB|) and r = 1/(1+e), {p,q} = {e*r,r} and p*q = e*r*r in both cases
+      double fApB = dec_values[i] * A + B;
+      double e = exp(-fabs(fApB));
+      double r = 1.0 / (1.0 + e);
+      double p = fApB >= 0 ? e * r : r;
+      double d2 = e * r * r;
+      double d1 = t[i] - p;
       h11 += dec_values[i] * dec_values[i] * d2;
       h22 += d2;
       h21 += dec_values[i] * d2;
-      d1 = t[i] - p;
       g1 += dec_values[i] * d1;
       g2 += d1;
     }
@@ -1496,14 +1841,7 @@ static void sigmoid_train(int l, const double *dec_values, const double *labels,
       newB = B + stepsize * dB;
 
       // New function value
-      newf = 0.0;
-      for (i = 0; i < l; i++) {
-        fApB = dec_values[i] * newA + newB;
-        if (fApB >= 0)
-          newf += t[i] * fApB + log(1 + exp(-fApB));
-        else
-          newf += (t[i] - 1) * fApB + log(1 + exp(fApB));
-      }
+      newf = sigmoid_objective(l, dec_values, t, newA, newB);
       // Check sufficient decrease
       if (newf < fval + 0.0001 * stepsize * gd) {
         A = newA;
@@ -1585,8 +1923,71 @@ static void multiclass_probability(int k, double **r, double *p) {
   free(Qp);
 }
 
+// Decision values of the held-out data perm[begin...end-1] for svm_binary_svc_probability
+static void svm_binary_svc_probability_fold(const svm_problem *prob, const svm_parameter *param, double Cp, double Cn, const int *perm, int begin, int end, double *dec_values) {
+  int j, k;
+  struct svm_problem subprob;
+
+  subprob.l = prob->l - (end - begin);
+  subprob.x = Malloc(struct svm_node *, subprob.l);
+  subprob.y = Malloc(double, subprob.l);
+  subprob.W = prob->W != NULL ? Malloc(double, subprob.l) : NULL;
+
+  k = 0;
+  for (j = 0; j < begin; j++) {
+    subprob.x[k] = prob->x[perm[j]];
+    subprob.y[k] = prob->y[perm[j]];
+    if (subprob.W != NULL) subprob.W[k] = prob->W[perm[j]];
+    ++k;
+  }
+  for (j = end; j < prob->l; j++) {
+    subprob.x[k] = prob->x[perm[j]];
+    subprob.y[k] = prob->y[perm[j]];
+    if (subprob.W != NULL) subprob.W[k] = prob->W[perm[j]];
+    ++k;
+  }
+  int p_count = 0, n_count = 0;
+  for (j = 0; j < k; j++)
+    if (subprob.y[j] > 0)
+      p_count++;
+    else
+      n_count++;
+
+  if (p_count == 0 && n_count == 0)
+    for (j = begin; j < end; j++) dec_values[perm[j]] = 0;
+  else if (p_count > 0 && n_count == 0)
+    for (j = begin; j < end; j++) dec_values[perm[j]] = 1;
+  else if (p_count == 0 && n_count > 0)
+    for (j = begin; j < end; j++) dec_values[perm[j]] = -1;
+  else {
+    svm_parameter subparam = *param;
+    subparam.probability = 0;
+    subparam.C = 1.0;
+    subparam.nr_weight = 2;
+    subparam.weight_label = Malloc(int, 2);
+    subparam.weight = Malloc(double, 2);
+    subparam.weight_label[0] = +1;
+    subparam.weight_label[1] = -1;
+    subparam.weight[0] = Cp;
+    subparam.weight[1] = Cn;
+    struct svm_model *submodel = svm_train(&subprob, &subparam);
+    for (j = begin; j < end; j++) {
+      svm_predict_values(submodel, prob->x[perm[j]], &(dec_values[perm[j]]));
+      // ensure +1 -1 order; reason not using CV subroutine
+      dec_values[perm[j]] *= submodel->label[0];
+    }
+    svm_free_and_destroy_model(&submodel);
+    svm_destroy_param(&subparam);
+  }
+  free(subprob.x);
+  free(subprob.y);
+  free(subprob.W);
+}
+
 // Cross-validation decision values for probability estimates
-static void svm_binary_svc_probability(const svm_problem *prob, const svm_parameter *param, double Cp, double Cn, double &probA, double &probB) {
+// With param->nr_thread > 1 the folds are trained on up to that many threads, sharing param->cache_size between them; otherwise
+// one after another, so callers only get threads they asked for
+static void svm_binary_svc_probability(const svm_problem *prob, const svm_parameter *param, double Cp, double Cn, double &probA, double &probB, Random &rng) {
   int i;
   int nr_fold = 5;
   int *perm = Malloc(int, prob->l);
@@ -1595,66 +1996,18 @@ static void svm_binary_svc_probability(const svm_problem *prob, const svm_parame
   // random shuffle
   for (i = 0; i < prob->l; i++) perm[i] = i;
   for (i = 0; i < prob->l; i++) {
-    int j = i + rand() % (prob->l - i);
+    int j = i + rng.next_int(prob->l - i);
     swap(perm[i], perm[j]);
   }
-  for (i = 0; i < nr_fold; i++) {
-    int begin = i * prob->l / nr_fold;
-    int end = (i + 1) * prob->l / nr_fold;
-    int j, k;
-    struct svm_problem subprob;
-
-    subprob.l = prob->l - (end - begin);
-    subprob.x = Malloc(struct svm_node *, subprob.l);
-    subprob.y = Malloc(double, subprob.l);
-
-    k = 0;
-    for (j = 0; j < begin; j++) {
-      subprob.x[k] = prob->x[perm[j]];
-      subprob.y[k] = prob->y[perm[j]];
-      ++k;
-    }
-    for (j = end; j < prob->l; j++) {
-      subprob.x[k] = prob->x[perm[j]];
-      subprob.y[k] = prob->y[perm[j]];
-      ++k;
-    }
-    int p_count = 0, n_count = 0;
-    for (j = 0; j < k; j++)
-      if (subprob.y[j] > 0)
-        p_count++;
-      else
-        n_count++;
-
-    if (p_count == 0 && n_count == 0)
-      for (j = begin; j < end; j++) dec_values[perm[j]] = 0;
-    else if (p_count > 0 && n_count == 0)
-      for (j = begin; j < end; j++) dec_values[perm[j]] = 1;
-    else if (p_count == 0 && n_count > 0)
-      for (j = begin; j < end; j++) dec_values[perm[j]] = -1;
-    else {
-      svm_parameter subparam = *param;
-      subparam.probability = 0;
-      subparam.C = 1.0;
-      subparam.nr_weight = 2;
-      subparam.weight_label = Malloc(int, 2);
-      subparam.weight = Malloc(double, 2);
-      subparam.weight_label[0] = +1;
-      subparam.weight_label[1] = -1;
-      subparam.weight[0] = Cp;
-      subparam.weight[1] = Cn;
-      struct svm_model *submodel = svm_train(&subprob, &subparam);
-      for (j = begin; j < end; j++) {
-        svm_predict_values(submodel, prob->x[perm[j]], &(dec_values[perm[j]]));
-        // ensure +1 -1 order; reason not using CV subroutine
-        dec_values[perm[j]] *= submodel->label[0];
-      }
-      svm_free_and_destroy_model(&submodel);
-      svm_destroy_param(&subparam);
-    }
-    free(subprob.x);
-    free(subprob.y);
-  }
+  int nr_thread = param->nr_thread > 1 ? svm_thread_count(param->nr_thread, nr_fold) : 1;
+  svm_parameter subparam = *param;
+  subparam.cache_size = param->cache_size / nr_thread;
+  subparam.nr_thread = 1;
+  parallel_for(nr_fold, nr_thread, [&](int fold) {
+    int begin = fold * prob->l / nr_fold;
+    int end = (fold + 1) * prob->l / nr_fold;
+    svm_binary_svc_probability_fold(prob, &subparam, Cp, Cn, perm, begin, end, dec_values);
+  });
   sigmoid_train(prob->l, dec_values, prob->y, probA, probB);
   free(dec_values);
   free(perm);
@@ -1755,13 +2108,121 @@ static void svm_group_classes(const svm_problem *prob, int *nr_class_ret, int **
   free(data_label);
 }
 
+// Squared norms of the SVs, which let RBF predictions use ||x||^2 + ||sv||^2 - 2 x.sv like Kernel does
+static void svm_compute_sv_square(svm_model *model) {
+  model->sv_square = NULL;
+  if (model->param.kernel_type != RBF) return;
+  model->sv_square = Malloc(double, model->l);
+  for (int i = 0; i < model->l; i++) model->sv_square[i] = Kernel::dot(model->SV[i], model->SV[i]);
+}
+
+// Kernel value between x and the i-th SV, x_square being dot(x,x) when the model has sv_square
+static inline double svm_sv_kernel(const svm_model *model, const svm_node *x, double x_square, int i) {
+  if (model->sv_square != NULL) return kernels::fromDot<RBF>(Kernel::dot(x, model->SV[i]), x_square + model->sv_square[i], model->param.gamma, 0, 0);
+  return Kernel::k_function(x, model->SV[i], model->param);
+}
+
+// kernel_type of the loop below that goes through Kernel::k_function, for precomputed kernels and RBF models without sv_square
+#define GENERIC_KERNEL (-1)
+
+template <int KERNEL_TYPE>
+static void svm_sv_kernels_of(const svm_model *model, const svm_node *x, double x_square, int begin, int end, double *kvalue) {
+  const svm_parameter &param = model->param;
+  for (int i = begin; i < end; i++) {
+    const svm_node *sv = model->SV[i];
+    if constexpr (KERNEL_TYPE == GENERIC_KERNEL)
+      kvalue[i] = Kernel::k_function(x, sv, param);
+    else
+      kvalue[i] = kernels::fromDot<KERNEL_TYPE>(Kernel::dot(x, sv), KERNEL_TYPE == RBF ? x_square + model->sv_square[i] : 0, param.gamma, param.coef0, param.degree);
+  }
+}
+
+// kvalue[i] = K(x, SV[i]) for i in [begin,end), with the loop instantiated for the kernel of the model
+static void svm_sv_kernels(const svm_model *model, const svm_node *x, double x_square, int begin, int end, double *kvalue) {
+  switch (model->param.kernel_type) {
+    case LINEAR:
+      svm_sv_kernels_of<LINEAR>(model, x, x_square, begin, end, kvalue);
+      break;
+    case POLY:
+      svm_sv_kernels_of<POLY>(model, x, x_square, begin, end, kvalue);
+      break;
+    case RBF:
+      if (model->sv_square != NULL)
+        svm_sv_kernels_of<RBF>(model, x, x_square, begin, end, kvalue);
+      else
+        svm_sv_kernels_of<GENERIC_KERNEL>(model, x, x_square, begin, end, kvalue);
+      break;
+    case SIGMOID:
+      svm_sv_kernels_of<SIGMOID>(model, x, x_square, begin, end, kvalue);
+      break;
+    default:
+      svm_sv_kernels_of<GENERIC_KERNEL>(model, x, x_square, begin, end, kvalue);
+  }
+}
+
+// Trains again on param->sv_budget of the SVs of the model trained without the budget, if it has more
+static svm_model *svm_train_with_sv_budget(const svm_problem *prob, const svm_parameter *param) {
+  svm_parameter subparam = *param;
+  subparam.sv_budget = 0;
+  svm_model *model = svm_train(prob, &subparam);
+  int budget = param->sv_budget;
+  if (model->l <= budget) {
+    model->param = *param;
+    return model;
+  }
+  info("Total nSV = %d, training again on %d of them\n", model->l, budget);
+  int l = prob->l;
+  int nr_class = model->nr_class;
+  int *group = Malloc(int, l);
+  for (int i = 0; i < l; i++) group[i] = -1;
+  for (int c = 0, i = 0; c < nr_class; c++)
+    for (int k = 0; k < model->nSV[c]; k++, i++) group[model->sv_indices[i] - 1] = c;
+  // a class without SVs still has to be in the problem, so all its points are candidates
+  for (int c = 0; c < nr_class; c++)
+    if (model->nSV[c] == 0)
+      for (int i = 0; i < l; i++)
+        if ((int)prob->y[i] == model->label[c]) group[i] = c;
+  bool *kept = Malloc(bool, l);
+  Random rng(param->seed);
+  int nr_kept = svm_keep_random(group, nr_class, l, budget, kept, rng);
+  svm_problem sub_prob;
+  sub_prob.l = nr_kept;
+  sub_prob.x = Malloc(svm_node *, nr_kept);
+  sub_prob.y = Malloc(double, nr_kept);
+  sub_prob.W = prob->W != NULL ? Malloc(double, nr_kept) : NULL;
+  int *index = Malloc(int, nr_kept);
+  int k = 0;
+  for (int i = 0; i < l; i++)
+    if (kept[i]) {
+      sub_prob.x[k] = prob->x[i];
+      sub_prob.y[k] = prob->y[i];
+      if (sub_prob.W != NULL) sub_prob.W[k] = prob->W[i];
+      index[k++] = i;
+    }
+  svm_free_and_destroy_model(&model);
+  model = svm_train(&sub_prob, &subparam);
+  // the SVs already point into prob, only their indices refer to sub_prob
+  for (int i = 0; i < model->l; i++) model->sv_indices[i] = index[model->sv_indices[i] - 1] + 1;
+  model->param = *param;
+  free(index);
+  free(sub_prob.x);
+  free(sub_prob.y);
+  free(sub_prob.W);
+  free(kept);
+  free(group);
+  return model;
+}
+
 //
 // Interface functions
 //
 svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
+  if (param->sv_budget > 0) return svm_train_with_sv_budget(prob, param);
   svm_model *model = Malloc(svm_model, 1);
   model->param = *param;
   model->free_sv = 0;  // XXX
+  model->mapping = NULL;
+  model->mapping_size = 0;
 
   if (param->svm_type == ONE_CLASS || param->svm_type == EPSILON_SVR || param->svm_type == NU_SVR) {
     // regression or one-class-svm
@@ -1799,6 +2260,7 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
       }
 
     free(f.alpha);
+    svm_compute_sv_square(model);
   } else {
     // classification
     int l = prob->l;
@@ -1815,6 +2277,11 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
     svm_node **x = Malloc(svm_node *, l);
     int i;
     for (i = 0; i < l; i++) x[i] = prob->x[perm[i]];
+    double *W = NULL;
+    if (prob->W != NULL) {
+      W = Malloc(double, l);
+      for (i = 0; i < l; i++) W[i] = prob->W[perm[i]];
+    }
 
     // calculate weighted C
 
@@ -1851,17 +2318,23 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
         sub_prob.l = ci + cj;
         sub_prob.x = Malloc(svm_node *, sub_prob.l);
         sub_prob.y = Malloc(double, sub_prob.l);
+        sub_prob.W = W != NULL ? Malloc(double, sub_prob.l) : NULL;
         int k;
         for (k = 0; k < ci; k++) {
           sub_prob.x[k] = x[si + k];
           sub_prob.y[k] = +1;
+          if (W != NULL) sub_prob.W[k] = W[si + k];
         }
         for (k = 0; k < cj; k++) {
           sub_prob.x[ci + k] = x[sj + k];
           sub_prob.y[ci + k] = -1;
+          if (W != NULL) sub_prob.W[ci + k] = W[sj + k];
         }
 
-        if (param->probability) svm_binary_svc_probability(&sub_prob, param, weighted_C[i], weighted_C[j], probA[p], probB[p]);
+        if (param->probability) {
+          Random rng(Random::derive_seed(param->seed, p));
+          svm_binary_svc_probability(&sub_prob, param, weighted_C[i], weighted_C[j], probA[p], probB[p], rng);
+        }
 
         f[p] = svm_train_one(&sub_prob, param, weighted_C[i], weighted_C[j]);
         for (k = 0; k < ci; k++)
@@ -1870,6 +2343,7 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
           if (!nonzero[sj + k] && fabs(f[p].alpha[ci + k]) > 0) nonzero[sj + k] = true;
         free(sub_prob.x);
         free(sub_prob.y);
+        free(sub_prob.W);
         ++p;
       }
 
@@ -1957,28 +2431,24 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param) {
     free(perm);
     free(start);
     free(x);
+    free(W);
     free(weighted_C);
     free(nonzero);
     for (i = 0; i < nr_class * (nr_class - 1) / 2; i++) free(f[i].alpha);
     free(f);
     free(nz_count);
     free(nz_start);
+    svm_compute_sv_square(model);
   }
   return model;
 }
 
-// Stratified cross validation
-void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target) {
+// Stratified fold assignment: perm[fold_start[i]...fold_start[i+1]-1] are the indices of fold i
+// perm, length l, and fold_start, length nr_fold+1, must be allocated before calling this subroutine
+static void svm_assign_folds(const svm_problem *prob, const svm_parameter *param, int nr_fold, int *perm, int *fold_start, Random &rng) {
   int i;
-  int *fold_start;
   int l = prob->l;
-  int *perm = Malloc(int, l);
   int nr_class;
-  if (nr_fold > l) {
-    nr_fold = l;
-    fprintf(stderr, "WARNING: # folds > # data. Will use # folds = # data instead (i.e., leave-one-out cross validation)\n");
-  }
-  fold_start = Malloc(int, nr_fold + 1);
   // stratified cv may not give leave-one-out rate
   // Each class to l folds -> some folds may have zero elements
   if ((param->svm_type == C_SVC || param->svm_type == NU_SVC) && nr_fold < l) {
@@ -1994,7 +2464,7 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
     for (i = 0; i < l; i++) index[i] = perm[i];
     for (c = 0; c < nr_class; c++)
       for (i = 0; i < count[c]; i++) {
-        int j = i + rand() % (count[c] - i);
+        int j = i + rng.next_int(count[c] - i);
         swap(index[start[c] + j], index[start[c] + i]);
       }
     for (i = 0; i < nr_fold; i++) {
@@ -2022,48 +2492,244 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
   } else {
     for (i = 0; i < l; i++) perm[i] = i;
     for (i = 0; i < l; i++) {
-      int j = i + rand() % (l - i);
+      int j = i + rng.next_int(l - i);
       swap(perm[i], perm[j]);
     }
     for (i = 0; i <= nr_fold; i++) fold_start[i] = i * l / nr_fold;
   }
+}
 
-  for (i = 0; i < nr_fold; i++) {
-    int begin = fold_start[i];
-    int end = fold_start[i + 1];
-    int j, k;
-    struct svm_problem subprob;
-
-    subprob.l = l - (end - begin);
-    subprob.x = Malloc(struct svm_node *, subprob.l);
-    subprob.y = Malloc(double, subprob.l);
-
-    k = 0;
-    for (j = 0; j < begin; j++) {
-      subprob.x[k] = prob->x[perm[j]];
-      subprob.y[k] = prob->y[perm[j]];
-      ++k;
-    }
-    for (j = end; j < l; j++) {
-      subprob.x[k] = prob->x[perm[j]];
-      subprob.y[k] = prob->y[perm[j]];
-      ++k;
-    }
-    struct svm_model *submodel = svm_train(&subprob, param);
-    if (param->probability && (param->svm_type == C_SVC || param->svm_type == NU_SVC)) {
-      double *prob_estimates = Malloc(double, svm_get_nr_class(submodel));
-      for (j = begin; j < end; j++) target[perm[j]] = svm_predict_probability(submodel, prob->x[perm[j]], prob_estimates);
-      free(prob_estimates);
-    } else
-      for (j = begin; j < end; j++) target[perm[j]] = svm_predict(submodel, prob->x[perm[j]]);
-    svm_free_and_destroy_model(&submodel);
-    free(subprob.x);
-    free(subprob.y);
+// Train on everything but perm[begin...end-1] and predict the held-out data into target
+static void svm_cross_validation_fold(const svm_problem *prob, const svm_parameter *param, int fold, const int *perm, int begin, int end, double *target) {
+  int l = prob->l;
+  int j, k;
+  struct svm_problem subprob;
+  svm_parameter subparam = *param;
+  subparam.seed = Random::derive_seed(param->seed, fold);
+
+  subprob.l = l - (end - begin);
+  subprob.x = Malloc(struct svm_node *, subprob.l);
+  subprob.y = Malloc(double, subprob.l);
+  subprob.W = prob->W != NULL ? Malloc(double, subprob.l) : NULL;
+
+  k = 0;
+  for (j = 0; j < begin; j++) {
+    subprob.x[k] = prob->x[perm[j]];
+    subprob.y[k] = prob->y[perm[j]];
+    if (subprob.W != NULL) subprob.W[k] = prob->W[perm[j]];
+    ++k;
+  }
+  for (j = end; j < l; j++) {
+    subprob.x[k] = prob->x[perm[j]];
+    subprob.y[k] = prob->y[perm[j]];
+    if (subprob.W != NULL) subprob.W[k] = prob->W[perm[j]];
+    ++k;
+  }
+  struct svm_model *submodel = svm_train(&subprob, &subparam);
+  if (param->probability && (param->svm_type == C_SVC || param->svm_type == NU_SVC)) {
+    double *prob_estimates = Malloc(double, svm_get_nr_class(submodel));
+    for (j = begin; j < end; j++) target[perm[j]] = svm_predict_probability(submodel, prob->x[perm[j]], prob_estimates);
+    free(prob_estimates);
+  } else
+    for (j = begin; j < end; j++) target[perm[j]] = svm_predict(submodel, prob->x[perm[j]]);
+  svm_free_and_destroy_model(&submodel);
+  free(subprob.x);
+  free(subprob.y);
+  free(subprob.W);
+}
+
+static int svm_clamp_nr_fold(const svm_problem *prob, int nr_fold) {
+  if (nr_fold > prob->l) {
+    nr_fold = prob->l;
+    fprintf(stderr, "WARNING: # folds > # data. Will use # folds = # data instead (i.e., leave-one-out cross validation)\n");
   }
+  return nr_fold;
+}
+
+// Stratified cross validation
+void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target) {
+  nr_fold = svm_clamp_nr_fold(prob, nr_fold);
+  int *perm = Malloc(int, prob->l);
+  int *fold_start = Malloc(int, nr_fold + 1);
+  Random rng(param->seed);
+  svm_assign_folds(prob, param, nr_fold, perm, fold_start, rng);
+  for (int i = 0; i < nr_fold; i++) svm_cross_validation_fold(prob, param, i, perm, fold_start[i], fold_start[i + 1], target);
+  free(fold_start);
+  free(perm);
+}
+
+// Stratified cross validation training up to param->nr_thread folds at the same time
+// The folds and the results are the same as the ones of svm_cross_validation
+// Each concurrent fold gets an equal share of param->cache_size, so the total kernel cache stays within it
+void svm_cross_validation_parallel(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target) {
+  nr_fold = svm_clamp_nr_fold(prob, nr_fold);
+  int *perm = Malloc(int, prob->l);
+  int *fold_start = Malloc(int, nr_fold + 1);
+  Random rng(param->seed);
+  svm_assign_folds(prob, param, nr_fold, perm, fold_start, rng);
+  int nr_thread = svm_thread_count(param->nr_thread, nr_fold);
+  svm_parameter subparam = *param;
+  subparam.cache_size = param->cache_size / nr_thread;
+  subparam.nr_thread = 1;
+  parallel_for(nr_fold, nr_thread, [&](int i) { svm_cross_validation_fold(prob, &subparam, i, perm, fold_start[i], fold_start[i + 1], target); });
   free(fold_start);
   free(perm);
 }
 
+//
+// Model compaction
+//
+// SVs of one class with identical features contribute to every decision function through the same kernel value,
+// so they can be replaced by one SV carrying the sums of their coefficients without changing any prediction.
+// SVs whose coefficients are all below a tolerance in magnitude can then be dropped, which changes the decision values
+// by at most tolerance times the sum of their kernel values.
+//
+
+// FNV-1a over the indices and values, with -0 hashed as 0 so that rows svm_same_row finds the same hash the same
+uint64_t svm_hash_row(const svm_node *x) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; x->index != -1; x++) {
+    hash = (hash ^ (uint64_t)(uint32_t)x->index) * 1099511628211ULL;
+    double value = x->value;
+    if (value == 0) value = 0;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    hash = (hash ^ bits) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+int svm_same_row(const svm_node *x, const svm_node *y) {
+  for (; x->index != -1 && x->index == y->index && x->value == y->value; x++, y++);
+  return x->index == -1 && y->index == -1;
+}
+
+struct svm_hashed_row {
+  uint64_t hash;
+  int index;
+};
+
+static int svm_compare_hashed_rows(const void *a, const void *b) {
+  const svm_hashed_row *x = (const svm_hashed_row *)a;
+  const svm_hashed_row *y = (const svm_hashed_row *)b;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+svm_model *svm_compact_model(const svm_model *model, double tolerance) {
+  int l = model->l;
+  int nr_class = model->nr_class;
+  int nr_coef = nr_class - 1;
+  // regression and one-class models have no classes, and all their SVs may be merged
+  int nr_group = model->nSV != NULL ? nr_class : 1;
+  int *group_start = Malloc(int, nr_group + 1);
+  group_start[0] = 0;
+  for (int i = 0; i < nr_group; i++) group_start[i + 1] = group_start[i] + (model->nSV != NULL ? model->nSV[i] : l);
+
+  // merged[i] is the first SV of the group of i with the same features, whose coefficients receive those of i
+  int *merged = Malloc(int, l);
+  svm_hashed_row *rows = Malloc(svm_hashed_row, l);
+  for (int i = 0; i < l; i++) {
+    merged[i] = i;
+    rows[i].hash = svm_hash_row(model->SV[i]);
+    rows[i].index = i;
+  }
+  for (int g = 0; g < nr_group; g++) {
+    int begin = group_start[g];
+    int end = group_start[g + 1];
+    qsort(rows + begin, end - begin, sizeof(svm_hashed_row), svm_compare_hashed_rows);
+    for (int i = begin; i < end; i++) {
+      for (int j = i - 1; j >= begin && rows[j].hash == rows[i].hash; j--) {
+        if (merged[rows[j].index] == rows[j].index && svm_same_row(model->SV[rows[j].index], model->SV[rows[i].index])) {
+          merged[rows[i].index] = rows[j].index;
+          break;
+        }
+      }
+    }
+  }
+  free(rows);
+
+  double **coef = Malloc(double *, nr_coef);
+  for (int k = 0; k < nr_coef; k++) {
+    coef[k] = Malloc(double, l);
+    for (int i = 0; i < l; i++) coef[k][i] = 0;
+    for (int i = 0; i < l; i++) coef[k][merged[i]] += model->sv_coef[k][i];
+  }
+
+  // SVs are kept in their order, so the classes stay contiguous
+  int *kept = Malloc(int, l);
+  int nr_kept = 0;
+  int nr_node = 0;
+  int *nSV = model->nSV != NULL ? Malloc(int, nr_class) : NULL;
+  for (int g = 0; g < nr_group; g++) {
+    if (nSV != NULL) nSV[g] = 0;
+    for (int i = group_start[g]; i < group_start[g + 1]; i++) {
+      if (merged[i] != i) continue;
+      double largest = 0;
+      for (int k = 0; k < nr_coef; k++) largest = max(largest, fabs(coef[k][i]));
+      if (largest < tolerance || largest == 0) continue;
+      kept[nr_kept++] = i;
+      if (nSV != NULL) nSV[g]++;
+      const svm_node *x = model->SV[i];
+      while (x++->index != -1) nr_node++;
+      nr_node++;
+    }
+  }
+
+  svm_model *compact = Malloc(svm_model, 1);
+  compact->param = model->param;
+  compact->param.weight_label = NULL;
+  compact->param.weight = NULL;
+  compact->param.nr_weight = 0;
+  compact->nr_class = nr_class;
+  compact->l = nr_kept;
+  compact->SV = Malloc(svm_node *, nr_kept);
+  svm_node *x_space = nr_kept > 0 ? Malloc(svm_node, nr_node) : NULL;
+  compact->sv_coef = Malloc(double *, nr_coef);
+  for (int k = 0; k < nr_coef; k++) compact->sv_coef[k] = Malloc(double, nr_kept);
+  compact->sv_indices = model->sv_indices != NULL ? Malloc(int, nr_kept) : NULL;
+  for (int i = 0; i < nr_kept; i++) {
+    int from = kept[i];
+    compact->SV[i] = x_space;
+    const svm_node *x = model->SV[from];
+    do *x_space++ = *x; while (x++->index != -1);
+    for (int k = 0; k < nr_coef; k++) compact->sv_coef[k][i] = coef[k][from];
+    if (compact->sv_indices != NULL) compact->sv_indices[i] = model->sv_indices[from];
+  }
+  svm_compute_sv_square(compact);
+
+  int nr_pair = nr_class * (nr_class - 1) / 2;
+  compact->rho = Malloc(double, nr_pair);
+  memcpy(compact->rho, model->rho, nr_pair * sizeof(double));
+  compact->probA = NULL;
+  compact->probB = NULL;
+  int nr_prob = model->nSV != NULL ? nr_pair : 1;
+  if (model->probA != NULL) {
+    compact->probA = Malloc(double, nr_prob);
+    memcpy(compact->probA, model->probA, nr_prob * sizeof(double));
+  }
+  if (model->probB != NULL) {
+    compact->probB = Malloc(double, nr_prob);
+    memcpy(compact->probB, model->probB, nr_prob * sizeof(double));
+  }
+  compact->label = NULL;
+  if (model->label != NULL) {
+    compact->label = Malloc(int, nr_class);
+    memcpy(compact->label, model->label, nr_class * sizeof(int));
+  }
+  compact->nSV = nSV;
+  compact->free_sv = 1;
+  compact->mapping = NULL;
+  compact->mapping_size = 0;
+
+  for (int k = 0; k < nr_coef; k++) free(coef[k]);
+  free(coef);
+  free(kept);
+  free(merged);
+  free(group_start);
+  return compact;
+}
+
 int svm_get_svm_type(const svm_model *model) { return model->param.svm_type; }
 
 int svm_get_nr_class(const svm_model *model) { return model->nr_class; }
@@ -2080,6 +2746,13 @@ void svm_get_sv_indices(const svm_model *model, int *indices) {
 
 int svm_get_nr_sv(const svm_model *model) { return model->l; }
 
+void svm_get_sv_start(const svm_model *model, int *start) {
+  if (model->nSV != NULL) {
+    start[0] = 0;
+    for (int i = 1; i < model->nr_class; i++) start[i] = start[i - 1] + model->nSV[i - 1];
+  }
+}
+
 double svm_get_svr_probability(const svm_model *model) {
   if ((model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) && model->probA != NULL)
     return model->probA[0];
@@ -2089,12 +2762,13 @@ double svm_get_svr_probability(const svm_model *model) {
   }
 }
 
-double svm_predict_values(const svm_model *model, const svm_node *x, double *dec_values) {
+double svm_predict_values_workspace(const svm_model *model, const svm_node *x, double *dec_values, svm_workspace *workspace) {
   int i;
+  double x_square = model->sv_square != NULL ? Kernel::dot(x, x) : 0;
   if (model->param.svm_type == ONE_CLASS || model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) {
     double *sv_coef = model->sv_coef[0];
     double sum = 0;
-    for (i = 0; i < model->l; i++) sum += sv_coef[i] * Kernel::k_function(x, model->SV[i], model->param);
+    for (i = 0; i < model->l; i++) sum += sv_coef[i] * svm_sv_kernel(model, x, x_square, i);
     sum -= model->rho[0];
     *dec_values = sum;
 
@@ -2106,14 +2780,12 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double *dec
     int nr_class = model->nr_class;
     int l = model->l;
 
-    double *kvalue = Malloc(double, l);
-    for (i = 0; i < l; i++) kvalue[i] = Kernel::k_function(x, model->SV[i], model->param);
+    double *kvalue = workspace->kvalue;
+    svm_sv_kernels(model, x, x_square, 0, l, kvalue);
 
-    int *start = Malloc(int, nr_class);
-    start[0] = 0;
-    for (i = 1; i < nr_class; i++) start[i] = start[i - 1] + model->nSV[i - 1];
+    const int *start = workspace->start;
 
-    int *vote = Malloc(int, nr_class);
+    int *vote = workspace->vote;
     for (i = 0; i < nr_class; i++) vote[i] = 0;
 
     int p = 0;
@@ -2144,25 +2816,369 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double *dec
     for (i = 1; i < nr_class; i++)
       if (vote[i] > vote[vote_max_idx]) vote_max_idx = i;
 
-    free(kvalue);
-    free(start);
-    free(vote);
     return model->label[vote_max_idx];
   }
 }
 
-double svm_predict(const svm_model *model, const svm_node *x) {
+double svm_predict_values(const svm_model *model, const svm_node *x, double *dec_values) {
+  if (model->param.svm_type == ONE_CLASS || model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) return svm_predict_values_workspace(model, x, dec_values, NULL);
   int nr_class = model->nr_class;
-  double *dec_values;
-  if (model->param.svm_type == ONE_CLASS || model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR)
-    dec_values = Malloc(double, 1);
-  else
-    dec_values = Malloc(double, nr_class *(nr_class - 1) / 2);
-  double pred_result = svm_predict_values(model, x, dec_values);
-  free(dec_values);
+  svm_workspace workspace;
+  workspace.kvalue = Malloc(double, model->l);
+  workspace.start = Malloc(int, nr_class);
+  workspace.vote = Malloc(int, nr_class);
+  svm_get_sv_start(model, workspace.start);
+  double pred_result = svm_predict_values_workspace(model, x, dec_values, &workspace);
+  free(workspace.kvalue);
+  free(workspace.start);
+  free(workspace.vote);
   return pred_result;
 }
 
+//
+// Early-exit voting
+//
+// the pairs are played leader first: the class with the most votes (then the fewest defeats) that still has pairs to play meets the
+// opponent with the most votes among the ones it has not met, and voting stops once a class has more votes than any other can still reach
+// the winner is then the class max-wins voting over all pairs would pick, but usually after about nr_class - 1 pairs instead of all of them
+//
+static inline int svm_pair_index(int i, int j, int nr_class) { return i * (2 * nr_class - i - 1) / 2 + (j - i - 1); }
+
+static inline void svm_class_kernels(const svm_model *model, const svm_node *x, double x_square, const int *start, int c, double *kvalue, char *ready) {
+  if (ready[c]) return;
+  svm_sv_kernels(model, x, x_square, start[c], start[c] + model->nSV[c], kvalue);
+  ready[c] = 1;
+}
+
+// Decision value of the classifier of classes i < j, positive when it votes for i
+static inline double svm_pair_decision(const svm_model *model, const int *start, const double *kvalue, int i, int j) {
+  double sum = 0;
+  const double *coef1 = model->sv_coef[j - 1];
+  const double *coef2 = model->sv_coef[i];
+  for (int k = start[i]; k < start[i] + model->nSV[i]; k++) sum += coef1[k] * kvalue[k];
+  for (int k = start[j]; k < start[j] + model->nSV[j]; k++) sum += coef2[k] * kvalue[k];
+  return sum - model->rho[svm_pair_index(i, j, model->nr_class)];
+}
+
+static double svm_predict_early_exit(const svm_model *model, const svm_node *x, svm_workspace *workspace) {
+  int nr_class = model->nr_class;
+  double x_square = model->sv_square != NULL ? Kernel::dot(x, x) : 0;
+  // every class takes part before voting can stop, so all kernel values are needed and computed in one pass
+  double *kvalue = workspace->kvalue;
+  const int *start = workspace->start;
+  int *vote = workspace->vote;
+  int *lost = workspace->lost;
+  char *played = workspace->played;
+  svm_sv_kernels(model, x, x_square, 0, model->l, kvalue);
+  for (int c = 0; c < nr_class; c++) vote[c] = lost[c] = 0;
+  for (int c = 0; c < nr_class * nr_class; c++) played[c] = 0;
+
+  int best = 0;
+  for (int round = 0; round < nr_class * (nr_class - 1) / 2; round++) {
+    // a class ranks above another with more votes, then fewer defeats, then a lower index
+    int leader = -1;
+    for (int c = 0; c < nr_class; c++)
+      if (vote[c] + lost[c] < nr_class - 1 && (leader < 0 || vote[c] > vote[leader] || (vote[c] == vote[leader] && lost[c] < lost[leader]))) leader = c;
+    int opponent = -1;
+    for (int c = 0; c < nr_class; c++)
+      if (c != leader && !played[leader * nr_class + c] &&
+          (opponent < 0 || vote[c] > vote[opponent] || (vote[c] == vote[opponent] && lost[c] < lost[opponent])))
+        opponent = c;
+
+    int i = min(leader, opponent);
+    int j = max(leader, opponent);
+    played[i * nr_class + j] = played[j * nr_class + i] = 1;
+    if (svm_pair_decision(model, start, kvalue, i, j) > 0) {
+      ++vote[i];
+      ++lost[j];
+    } else {
+      ++vote[j];
+      ++lost[i];
+    }
+
+    best = 0;
+    for (int c = 1; c < nr_class; c++)
+      if (vote[c] > vote[best]) best = c;
+    bool decided = true;
+    for (int c = 0; c < nr_class && decided; c++)
+      if (c != best && vote[c] + (nr_class - 1 - vote[c] - lost[c]) >= vote[best]) decided = false;
+    if (decided) break;
+  }
+  return model->label[best];
+}
+
+//
+// Decision DAG
+//
+// the candidates are kept in a list; each step evaluates the classifier of the first and the last and drops the loser,
+// so nr_class - 1 classifiers decide instead of all nr_class * (nr_class - 1) / 2
+// the winner can differ from the one of max-wins voting, as no other class is checked against it
+//
+static double svm_predict_dag(const svm_model *model, const svm_node *x, svm_workspace *workspace) {
+  int nr_class = model->nr_class;
+  double x_square = model->sv_square != NULL ? Kernel::dot(x, x) : 0;
+  double *kvalue = workspace->kvalue;
+  const int *start = workspace->start;
+  char *ready = workspace->ready;
+  for (int c = 0; c < nr_class; c++) ready[c] = 0;
+
+  int first = 0;
+  int last = nr_class - 1;
+  while (first < last) {
+    svm_class_kernels(model, x, x_square, start, first, kvalue, ready);
+    svm_class_kernels(model, x, x_square, start, last, kvalue, ready);
+    if (svm_pair_decision(model, start, kvalue, first, last) > 0)
+      --last;
+    else
+      ++first;
+  }
+  return model->label[first];
+}
+
+double svm_predict_mode_workspace(const svm_model *model, const svm_node *x, int decision_mode, double *dec_values, svm_workspace *workspace) {
+  bool classification = model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC;
+  if (classification && decision_mode == EARLY_EXIT && model->nr_class > 2) return svm_predict_early_exit(model, x, workspace);
+  if (classification && decision_mode == DAG && model->nr_class > 2) return svm_predict_dag(model, x, workspace);
+  return svm_predict_values_workspace(model, x, dec_values, workspace);
+}
+
+double svm_predict_mode(const svm_model *model, const svm_node *x, int decision_mode) {
+  int nr_class = model->nr_class;
+  bool classification = model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC;
+  if (!classification || nr_class <= 2 || (decision_mode != EARLY_EXIT && decision_mode != DAG)) {
+    double *dec_values;
+    if (!classification)
+      dec_values = Malloc(double, 1);
+    else
+      dec_values = Malloc(double, nr_class *(nr_class - 1) / 2);
+    double pred_result = svm_predict_values(model, x, dec_values);
+    free(dec_values);
+    return pred_result;
+  }
+  svm_workspace workspace;
+  workspace.kvalue = Malloc(double, model->l);
+  workspace.start = Malloc(int, nr_class);
+  workspace.vote = Malloc(int, nr_class);
+  workspace.lost = Malloc(int, nr_class);
+  workspace.ready = Malloc(char, nr_class);
+  workspace.played = Malloc(char, nr_class * nr_class);
+  svm_get_sv_start(model, workspace.start);
+  double pred_result = svm_predict_mode_workspace(model, x, decision_mode, NULL, &workspace);
+  free(workspace.kvalue);
+  free(workspace.start);
+  free(workspace.vote);
+  free(workspace.lost);
+  free(workspace.ready);
+  free(workspace.played);
+  return pred_result;
+}
+
+// max-wins, as the allocations of the other modes cost more than they save here; repeated predictions can use
+// another mode without allocating through svm_predict_mode_workspace
+double svm_predict(const svm_model *model, const svm_node *x) { return svm_predict_mode(model, x, MAX_WINS); }
+
+//
+// Batch prediction
+//
+// the SVs are made dense once per call, over only the features some SV has, and the kernel values of BATCH_INPUTS inputs
+// against BATCH_SVS of them are computed at a time as a dense block product, so each tile of SVs is reused from cache by every
+// input of the block; features no SV has add nothing to a dot product, so a sparse model with large indices stays small
+// the kernel values are folded into the decision values right away, so memory is O(B * #pairs)
+//
+#define BATCH_INPUTS 64
+#define BATCH_SVS 64
+
+static int compare_int(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+// The columns of a dense row are the features some SV has, in increasing order of index. They are looked up in a table by index,
+// unless the indices are so sparse that the table would outgrow the SVs themselves, in which case the sorted indices are searched.
+struct feature_columns {
+  int dimension;  // number of columns
+  int max_index;  // largest index of a column
+  int *column_of; // column of each index up to max_index, -1 for features no SV has, or NULL
+  int *index;     // index of each column when column_of is NULL
+};
+
+static void feature_columns_init(feature_columns &columns, const svm_node *const *x, int n) {
+  int count = 0;
+  columns.max_index = -1;
+  for (int i = 0; i < n; i++)
+    for (const svm_node *px = x[i]; px->index != -1; ++px) {
+      count++;
+      columns.max_index = max(columns.max_index, px->index);
+    }
+  columns.dimension = 0;
+  columns.column_of = NULL;
+  columns.index = NULL;
+  if (columns.max_index <= 4 * count) {
+    columns.column_of = Malloc(int, columns.max_index + 1);
+    for (int k = 0; k <= columns.max_index; k++) columns.column_of[k] = -1;
+    for (int i = 0; i < n; i++)
+      for (const svm_node *px = x[i]; px->index != -1; ++px) columns.column_of[px->index] = 0;
+    for (int k = 0; k <= columns.max_index; k++)
+      if (columns.column_of[k] == 0) columns.column_of[k] = columns.dimension++;
+    return;
+  }
+  columns.index = Malloc(int, count);
+  count = 0;
+  for (int i = 0; i < n; i++)
+    for (const svm_node *px = x[i]; px->index != -1; ++px) columns.index[count++] = px->index;
+  qsort(columns.index, count, sizeof(int), compare_int);
+  for (int k = 0; k < count; k++)
+    if (columns.dimension == 0 || columns.index[k] != columns.index[columns.dimension - 1]) columns.index[columns.dimension++] = columns.index[k];
+}
+
+static inline int feature_column(const feature_columns &columns, int index) {
+  if (index < 0 || index > columns.max_index) return -1;
+  if (columns.column_of != NULL) return columns.column_of[index];
+  const int *found = (const int *)bsearch(&index, columns.index, columns.dimension, sizeof(int), compare_int);
+  return found != NULL ? (int)(found - columns.index) : -1;
+}
+
+// Scatter sparse rows into a dense row-major n x columns.dimension block, dropping the features that have no column,
+// and return the squared norms of the whole rows in square
+static void densify(const svm_node *const *x, int n, const feature_columns &columns, double *dense, double *square) {
+  int dimension = columns.dimension;
+  for (int i = 0; i < n; i++) {
+    double *row = dense + (long int)i * dimension;
+    for (int d = 0; d < dimension; d++) row[d] = 0;
+    double sum = 0;
+    for (const svm_node *px = x[i]; px->index != -1; ++px) {
+      int column = feature_column(columns, px->index);
+      if (column >= 0) row[column] = px->value;
+      sum += (double)px->value * px->value;
+    }
+    square[i] = sum;
+  }
+}
+
+void svm_predict_batch(const svm_model *model, const svm_node *const *x, int n, double *predictions, double *dec_values) {
+  int i, b, s;
+  int nr_class = model->nr_class;
+  int l = model->l;
+  const svm_parameter &param = model->param;
+  bool classification = model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC;
+  int nr_pair = classification ? nr_class * (nr_class - 1) / 2 : 1;
+
+  if (model->param.kernel_type == PRECOMPUTED) {
+    double *dec = Malloc(double, nr_pair);
+    for (b = 0; b < n; b++) {
+      predictions[b] = svm_predict_values(model, x[b], dec);
+      if (dec_values) memcpy(dec_values + (long int)b * nr_pair, dec, sizeof(double) * nr_pair);
+    }
+    free(dec);
+    return;
+  }
+
+  // for SV s and class j, pair_index[s's class * nr_class + j] is the pair both are in and coef_row the row of sv_coef with their coefficient
+  int *sv_class = Malloc(int, l);
+  int *pair_index = Malloc(int, nr_class * nr_class);
+  int *coef_row = Malloc(int, nr_class * nr_class);
+  if (classification) {
+    int *start = Malloc(int, nr_class);
+    svm_get_sv_start(model, start);
+    for (i = 0; i < nr_class; i++)
+      for (s = 0; s < model->nSV[i]; s++) sv_class[start[i] + s] = i;
+    free(start);
+    int p = 0;
+    for (i = 0; i < nr_class; i++)
+      for (int j = i + 1; j < nr_class; j++) {
+        pair_index[i * nr_class + j] = pair_index[j * nr_class + i] = p++;
+        coef_row[i * nr_class + j] = j - 1;
+        coef_row[j * nr_class + i] = i;
+      }
+  }
+
+  feature_columns columns;
+  feature_columns_init(columns, model->SV, l);
+  int dimension = columns.dimension;
+  double *x_dense = Malloc(double, (long int)BATCH_INPUTS * max(dimension, 1));
+  double *x_square = Malloc(double, BATCH_INPUTS);
+  double *sv_dense = Malloc(double, (long int)max(l, 1) * max(dimension, 1));
+  double *sv_square = Malloc(double, max(l, 1));
+  densify(model->SV, l, columns, sv_dense, sv_square);
+  double *kvalue = Malloc(double, BATCH_INPUTS * BATCH_SVS);
+  double *dec = Malloc(double, BATCH_INPUTS * nr_pair);
+  int *vote = Malloc(int, nr_class);
+
+  for (int x_begin = 0; x_begin < n; x_begin += BATCH_INPUTS) {
+    int x_count = min(BATCH_INPUTS, n - x_begin);
+    densify(x + x_begin, x_count, columns, x_dense, x_square);
+    for (i = 0; i < x_count * nr_pair; i++) dec[i] = 0;
+
+    for (int sv_begin = 0; sv_begin < l; sv_begin += BATCH_SVS) {
+      int sv_count = min(BATCH_SVS, l - sv_begin);
+
+      for (b = 0; b < x_count; b++) {
+        const double *xb = x_dense + (long int)b * dimension;
+        for (s = 0; s < sv_count; s++) {
+          const double *ys = sv_dense + (long int)(sv_begin + s) * dimension;
+          double sum = 0;
+          for (int d = 0; d < dimension; d++) sum += xb[d] * ys[d];
+          kvalue[b * BATCH_SVS + s] = kernels::fromDot(param.kernel_type, sum, x_square[b] + sv_square[sv_begin + s], param.gamma, param.coef0, param.degree);
+        }
+      }
+
+      for (b = 0; b < x_count; b++) {
+        double *decb = dec + b * nr_pair;
+        const double *kb = kvalue + b * BATCH_SVS;
+        if (classification) {
+          for (s = 0; s < sv_count; s++) {
+            int c = sv_class[sv_begin + s];
+            for (int j = 0; j < nr_class; j++)
+              if (j != c) decb[pair_index[c * nr_class + j]] += model->sv_coef[coef_row[c * nr_class + j]][sv_begin + s] * kb[s];
+          }
+        } else
+          for (s = 0; s < sv_count; s++) decb[0] += model->sv_coef[0][sv_begin + s] * kb[s];
+      }
+    }
+
+    for (b = 0; b < x_count; b++) {
+      double *decb = dec + b * nr_pair;
+      for (int p = 0; p < nr_pair; p++) decb[p] -= model->rho[p];
+      if (dec_values) memcpy(dec_values + (long int)(x_begin + b) * nr_pair, decb, sizeof(double) * nr_pair);
+      double prediction;
+      if (classification) {
+        for (i = 0; i < nr_class; i++) vote[i] = 0;
+        int p = 0;
+        for (i = 0; i < nr_class; i++)
+          for (int j = i + 1; j < nr_class; j++) {
+            if (decb[p] > 0)
+              ++vote[i];
+            else
+              ++vote[j];
+            p++;
+          }
+        int vote_max_idx = 0;
+        for (i = 1; i < nr_class; i++)
+          if (vote[i] > vote[vote_max_idx]) vote_max_idx = i;
+        prediction = model->label[vote_max_idx];
+      } else if (model->param.svm_type == ONE_CLASS)
+        prediction = (decb[0] > 0) ? 1 : -1;
+      else
+        prediction = decb[0];
+      predictions[x_begin + b] = prediction;
+    }
+  }
+
+  free(sv_class);
+  free(pair_index);
+  free(coef_row);
+  free(columns.column_of);
+  free(columns.index);
+  free(x_dense);
+  free(x_square);
+  free(sv_dense);
+  free(sv_square);
+  free(kvalue);
+  free(dec);
+  free(vote);
+}
+
 double svm_predict_probability(const svm_model *model, const svm_node *x, double *prob_estimates) {
   if ((model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC) && model->probA != NULL && model->probB != NULL) {
     int i;
@@ -2201,134 +3217,241 @@ static const char *svm_type_table[] = {"c_svc", "nu_svc", "one_class", "epsilon_
 
 static const char *kernel_type_table[] = {"linear", "polynomial", "rbf", "sigmoid", "precomputed", NULL};
 
-int svm_save_model(const char *model_file_name, const svm_model *model) {
-  FILE *fp = fopen(model_file_name, "w");
-  if (fp == NULL) return -1;
+//
+// Text model format
+//
+// numbers are formatted and parsed with std::to_chars and std::from_chars, which always use the "C" conventions,
+// so no global locale has to be switched; "%.17g" and "%.8g" are reproduced with the general format and explicit precision
+//
+class TextWriter {
+ public:
+  explicit TextWriter(FILE *fp) : fp(fp), used(0), ok(true) {}
+  ~TextWriter() { flush(); }
 
-  char *old_locale = setlocale(LC_ALL, NULL);
-  if (old_locale) {
-    old_locale = strdup(old_locale);
+  void put(const char *s) {
+    size_t n = strlen(s);
+    reserve(n);
+    memcpy(buffer + used, s, n);
+    used += n;
+  }
+  void put(char c) {
+    reserve(1);
+    buffer[used++] = c;
+  }
+  void put(int value) {
+    reserve(16);
+    used = std::to_chars(buffer + used, buffer + sizeof(buffer), value).ptr - buffer;
+  }
+  void put(double value, int precision) {
+    reserve(32);
+    used = std::to_chars(buffer + used, buffer + sizeof(buffer), value, std::chars_format::general, precision).ptr - buffer;
+  }
+  // flush the buffer, returning false if any write failed
+  bool flush() {
+    if (used > 0 && fwrite(buffer, 1, used, fp) != used) ok = false;
+    used = 0;
+    return ok;
   }
-  setlocale(LC_ALL, "C");
-
-  const svm_parameter &param = model->param;
 
-  fprintf(fp, "svm_type %s\n", svm_type_table[param.svm_type]);
-  fprintf(fp, "kernel_type %s\n", kernel_type_table[param.kernel_type]);
+ private:
+  FILE *fp;
+  char buffer[1 << 16];
+  size_t used;
+  bool ok;
 
-  if (param.kernel_type == POLY) fprintf(fp, "degree %d\n", param.degree);
+  void reserve(size_t n) {
+    if (used + n > sizeof(buffer)) flush();
+  }
+};
 
-  if (param.kernel_type == POLY || param.kernel_type == RBF || param.kernel_type == SIGMOID) fprintf(fp, "gamma %.17g\n", param.gamma);
+int svm_save_model(const char *model_file_name, const svm_model *model) {
+  FILE *fp = fopen(model_file_name, "w");
+  if (fp == NULL) return -1;
 
-  if (param.kernel_type == POLY || param.kernel_type == SIGMOID) fprintf(fp, "coef0 %.17g\n", param.coef0);
+  bool ok;
+  {
+    TextWriter out(fp);
+    const svm_parameter &param = model->param;
+
+    out.put("svm_type ");
+    out.put(svm_type_table[param.svm_type]);
+    out.put("\nkernel_type ");
+    out.put(kernel_type_table[param.kernel_type]);
+    out.put('\n');
+
+    if (param.kernel_type == POLY) {
+      out.put("degree ");
+      out.put(param.degree);
+      out.put('\n');
+    }
 
-  int nr_class = model->nr_class;
-  int l = model->l;
-  fprintf(fp, "nr_class %d\n", nr_class);
-  fprintf(fp, "total_sv %d\n", l);
+    if (param.kernel_type == POLY || param.kernel_type == RBF || param.kernel_type == SIGMOID) {
+      out.put("gamma ");
+      out.put(param.gamma, 17);
+      out.put('\n');
+    }
 
-  {
-    fprintf(fp, "rho");
-    for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) fprintf(fp, " %.17g", model->rho[i]);
-    fprintf(fp, "\n");
-  }
+    if (param.kernel_type == POLY || param.kernel_type == SIGMOID) {
+      out.put("coef0 ");
+      out.put(param.coef0, 17);
+      out.put('\n');
+    }
 
-  if (model->label) {
-    fprintf(fp, "label");
-    for (int i = 0; i < nr_class; i++) fprintf(fp, " %d", model->label[i]);
-    fprintf(fp, "\n");
-  }
+    int nr_class = model->nr_class;
+    int l = model->l;
+    out.put("nr_class ");
+    out.put(nr_class);
+    out.put("\ntotal_sv ");
+    out.put(l);
+    out.put('\n');
 
-  if (model->probA)  // regression has probA only
-  {
-    fprintf(fp, "probA");
-    for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) fprintf(fp, " %.17g", model->probA[i]);
-    fprintf(fp, "\n");
-  }
-  if (model->probB) {
-    fprintf(fp, "probB");
-    for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) fprintf(fp, " %.17g", model->probB[i]);
-    fprintf(fp, "\n");
-  }
+    {
+      out.put("rho");
+      for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) {
+        out.put(' ');
+        out.put(model->rho[i], 17);
+      }
+      out.put('\n');
+    }
 
-  if (model->nSV) {
-    fprintf(fp, "nr_sv");
-    for (int i = 0; i < nr_class; i++) fprintf(fp, " %d", model->nSV[i]);
-    fprintf(fp, "\n");
-  }
+    if (model->label) {
+      out.put("label");
+      for (int i = 0; i < nr_class; i++) {
+        out.put(' ');
+        out.put(model->label[i]);
+      }
+      out.put('\n');
+    }
 
-  fprintf(fp, "SV\n");
-  const double *const *sv_coef = model->sv_coef;
-  const svm_node *const *SV = model->SV;
+    if (model->probA)  // regression has probA only
+    {
+      out.put("probA");
+      for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) {
+        out.put(' ');
+        out.put(model->probA[i], 17);
+      }
+      out.put('\n');
+    }
+    if (model->probB) {
+      out.put("probB");
+      for (int i = 0; i < nr_class * (nr_class - 1) / 2; i++) {
+        out.put(' ');
+        out.put(model->probB[i], 17);
+      }
+      out.put('\n');
+    }
 
-  for (int i = 0; i < l; i++) {
-    for (int j = 0; j < nr_class - 1; j++) fprintf(fp, "%.17g ", sv_coef[j][i]);
+    if (model->nSV) {
+      out.put("nr_sv");
+      for (int i = 0; i < nr_class; i++) {
+        out.put(' ');
+        out.put(model->nSV[i]);
+      }
+      out.put('\n');
+    }
 
-    const svm_node *p = SV[i];
+    out.put("SV\n");
+    const double *const *sv_coef = model->sv_coef;
+    const svm_node *const *SV = model->SV;
 
-    if (param.kernel_type == PRECOMPUTED)
-      fprintf(fp, "0:%d ", (int)(p->value));
-    else
-      while (p->index != -1) {
-        fprintf(fp, "%d:%.8g ", p->index, p->value);
-        p++;
+    for (int i = 0; i < l; i++) {
+      for (int j = 0; j < nr_class - 1; j++) {
+        out.put(sv_coef[j][i], 17);
+        out.put(' ');
       }
-    fprintf(fp, "\n");
-  }
 
-  setlocale(LC_ALL, old_locale);
-  free(old_locale);
+      const svm_node *p = SV[i];
+
+      if (param.kernel_type == PRECOMPUTED) {
+        out.put("0:");
+        out.put((int)(p->value));
+        out.put(' ');
+      } else
+        while (p->index != -1) {
+          out.put(p->index);
+          out.put(':');
+          out.put(p->value, 8);
+          out.put(' ');
+          p++;
+        }
+      out.put('\n');
+    }
+    ok = out.flush();
+  }
 
-  if (ferror(fp) != 0 || fclose(fp) != 0)
+  if (!ok || ferror(fp) != 0 || fclose(fp) != 0)
     return -1;
   else
     return 0;
 }
 
-static char *line = NULL;
-static int max_line_len;
-
-static char *readline(FILE *input) {
-  int len;
+class TextReader {
+ public:
+  TextReader(const char *begin, const char *end) : p(begin), end(end) {}
+
+  // next whitespace-separated word, empty at the end of the input
+  std::string_view word() {
+    skip_space();
+    const char *begin = p;
+    while (p != end && !isspace((unsigned char)*p)) ++p;
+    return std::string_view(begin, p - begin);
+  }
+  // numbers are separated by blanks and may not span lines; a leading '+', which strtod and %d accept and from_chars does not, is skipped
+  template <class T>
+  bool number(T &value) {
+    skip_blank();
+    if (p != end && *p == '+' && (p + 1 == end || p[1] != '-')) ++p;
+    std::from_chars_result result = std::from_chars(p, end, value);
+    if (result.ec != std::errc()) return false;
+    p = result.ptr;
+    return true;
+  }
+  bool skip(char c) {
+    if (p == end || *p != c) return false;
+    ++p;
+    return true;
+  }
+  // true if only blanks remain on the current line, which is then consumed
+  bool end_of_line() {
+    skip_blank();
+    if (p == end) return true;
+    if (*p == '\r') ++p;
+    return p == end || (*p == '\n' && ++p);
+  }
+  void skip_line() {
+    while (p != end && *p++ != '\n') {
+    }
+  }
+  size_t remaining() const { return end - p; }
 
-  if (fgets(line, max_line_len, input) == NULL) return NULL;
+ private:
+  const char *p;
+  const char *end;
 
-  while (strrchr(line, '\n') == NULL) {
-    max_line_len *= 2;
-    line = (char *)realloc(line, max_line_len);
-    len = (int)strlen(line);
-    if (fgets(line + len, max_line_len - len, input) == NULL) break;
+  void skip_space() {
+    while (p != end && isspace((unsigned char)*p)) ++p;
   }
-  return line;
-}
+  void skip_blank() {
+    while (p != end && (*p == ' ' || *p == '\t')) ++p;
+  }
+};
 
-//
-// FSCANF helps to handle fscanf failures.
-// Its do-while block avoids the ambiguity when
-// if (...)
-//    FSCANF();
-// is used
-//
-#define FSCANF(_stream, _format, _var)                     \
-  do {                                                     \
-    if (fscanf(_stream, _format, _var) != 1) return false; \
-  } while (0)
-bool read_model_header(FILE *fp, svm_model *model) {
+static bool read_model_header(TextReader &in, svm_model *model) {
   svm_parameter &param = model->param;
   // parameters for training only won't be assigned, but arrays are assigned as NULL for safety
   param.nr_weight = 0;
   param.weight_label = NULL;
   param.weight = NULL;
 
-  char cmd[81];
   while (1) {
-    FSCANF(fp, "%80s", cmd);
+    std::string_view cmd = in.word();
+    if (cmd.empty()) return false;
 
-    if (strcmp(cmd, "svm_type") == 0) {
-      FSCANF(fp, "%80s", cmd);
+    if (cmd == "svm_type") {
+      std::string_view type = in.word();
       int i;
       for (i = 0; svm_type_table[i]; i++) {
-        if (strcmp(svm_type_table[i], cmd) == 0) {
+        if (type == svm_type_table[i]) {
           param.svm_type = i;
           break;
         }
@@ -2337,11 +3460,11 @@ bool read_model_header(FILE *fp, svm_model *model) {
         fprintf(stderr, "unknown svm type.\n");
         return false;
       }
-    } else if (strcmp(cmd, "kernel_type") == 0) {
-      FSCANF(fp, "%80s", cmd);
+    } else if (cmd == "kernel_type") {
+      std::string_view type = in.word();
       int i;
       for (i = 0; kernel_type_table[i]; i++) {
-        if (strcmp(kernel_type_table[i], cmd) == 0) {
+        if (type == kernel_type_table[i]) {
           param.kernel_type = i;
           break;
         }
@@ -2350,44 +3473,46 @@ bool read_model_header(FILE *fp, svm_model *model) {
         fprintf(stderr, "unknown kernel function.\n");
         return false;
       }
-    } else if (strcmp(cmd, "degree") == 0)
-      FSCANF(fp, "%d", &param.degree);
-    else if (strcmp(cmd, "gamma") == 0)
-      FSCANF(fp, "%lf", &param.gamma);
-    else if (strcmp(cmd, "coef0") == 0)
-      FSCANF(fp, "%lf", &param.coef0);
-    else if (strcmp(cmd, "nr_class") == 0)
-      FSCANF(fp, "%d", &model->nr_class);
-    else if (strcmp(cmd, "total_sv") == 0)
-      FSCANF(fp, "%d", &model->l);
-    else if (strcmp(cmd, "rho") == 0) {
+    } else if (cmd == "degree") {
+      if (!in.number(param.degree)) return false;
+    } else if (cmd == "gamma") {
+      if (!in.number(param.gamma)) return false;
+    } else if (cmd == "coef0") {
+      if (!in.number(param.coef0)) return false;
+    } else if (cmd == "nr_class") {
+      if (!in.number(model->nr_class)) return false;
+    } else if (cmd == "total_sv") {
+      if (!in.number(model->l)) return false;
+    } else if (cmd == "rho") {
       int n = model->nr_class * (model->nr_class - 1) / 2;
       model->rho = Malloc(double, n);
-      for (int i = 0; i < n; i++) FSCANF(fp, "%lf", &model->rho[i]);
-    } else if (strcmp(cmd, "label") == 0) {
+      for (int i = 0; i < n; i++)
+        if (!in.number(model->rho[i])) return false;
+    } else if (cmd == "label") {
       int n = model->nr_class;
       model->label = Malloc(int, n);
-      for (int i = 0; i < n; i++) FSCANF(fp, "%d", &model->label[i]);
-    } else if (strcmp(cmd, "probA") == 0) {
+      for (int i = 0; i < n; i++)
+        if (!in.number(model->label[i])) return false;
+    } else if (cmd == "probA") {
       int n = model->nr_class * (model->nr_class - 1) / 2;
       model->probA = Malloc(double, n);
-      for (int i = 0; i < n; i++) FSCANF(fp, "%lf", &model->probA[i]);
-    } else if (strcmp(cmd, "probB") == 0) {
+      for (int i = 0; i < n; i++)
+        if (!in.number(model->probA[i])) return false;
+    } else if (cmd == "probB") {
       int n = model->nr_class * (model->nr_class - 1) / 2;
       model->probB = Malloc(double, n);
-      for (int i = 0; i < n; i++) FSCANF(fp, "%lf", &model->probB[i]);
-    } else if (strcmp(cmd, "nr_sv") == 0) {
+      for (int i = 0; i < n; i++)
+        if (!in.number(model->probB[i])) return false;
+    } else if (cmd == "nr_sv") {
       int n = model->nr_class;
       model->nSV = Malloc(int, n);
-      for (int i = 0; i < n; i++) FSCANF(fp, "%d", &model->nSV[i]);
-    } else if (strcmp(cmd, "SV") == 0) {
-      while (1) {
-        int c = getc(fp);
-        if (c == EOF || c == '\n') break;
-      }
+      for (int i = 0; i < n; i++)
+        if (!in.number(model->nSV[i])) return false;
+    } else if (cmd == "SV") {
+      in.skip_line();
       break;
     } else {
-      fprintf(stderr, "unknown text in model file: [%s]\n", cmd);
+      fprintf(stderr, "unknown text in model file: [%.*s]\n", (int)cmd.size(), cmd.data());
       return false;
     }
   }
@@ -2395,33 +3520,89 @@ bool read_model_header(FILE *fp, svm_model *model) {
   return true;
 }
 
+// Read the SV lines in one pass, growing x_space as needed
+static bool read_model_svs(TextReader &in, svm_model *model) {
+  int m = model->nr_class - 1;
+  int l = model->l;
+  model->sv_coef = Malloc(double *, m);
+  int i;
+  for (i = 0; i < m; i++) model->sv_coef[i] = Malloc(double, l);
+  model->SV = Malloc(svm_node *, l);
+  if (l == 0) return true;
+
+  // a node takes at least 4 characters ("1:0 "), so this usually avoids any reallocation
+  size_t capacity = in.remaining() / 4 + l;
+  svm_node *x_space = Malloc(svm_node, capacity);
+  size_t *sv_start = (size_t *)calloc(l, sizeof(size_t));
+  size_t j = 0;
+  bool ok = true;
+  for (i = 0; i < l; i++) {
+    sv_start[i] = j;
+    for (int k = 0; k < m && ok; k++) ok = in.number(model->sv_coef[k][i]);
+    while (ok && !in.end_of_line()) {
+      if (j + 1 >= capacity) {
+        svm_node *grown = (svm_node *)realloc(x_space, 2 * capacity * sizeof(svm_node));
+        if (grown == NULL) {
+          // x_space is still valid and freed with the model
+          ok = false;
+          break;
+        }
+        x_space = grown;
+        capacity *= 2;
+      }
+      ok = in.number(x_space[j].index) && in.skip(':') && in.number(x_space[j].value);
+      ++j;
+    }
+    x_space[j++].index = -1;
+    if (!ok) {
+      fprintf(stderr, "ERROR: failed to read SV %d\n", i + 1);
+      break;
+    }
+  }
+  for (i = 0; i < l; i++) model->SV[i] = x_space + sv_start[i];
+  free(sv_start);
+  return ok;
+}
+
 svm_model *svm_load_model(const char *model_file_name) {
   FILE *fp = fopen(model_file_name, "rb");
   if (fp == NULL) return NULL;
 
-  char *old_locale = setlocale(LC_ALL, NULL);
-  if (old_locale) {
-    old_locale = strdup(old_locale);
+  // read the whole file at once
+  char *text = NULL;
+  long size = -1;
+  if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+    text = Malloc(char, size + 1);
+    if (fread(text, 1, size, fp) != (size_t)size) size = -1;
+  }
+  if (ferror(fp) != 0 || fclose(fp) != 0 || size < 0) {
+    free(text);
+    return NULL;
   }
-  setlocale(LC_ALL, "C");
+  TextReader in(text, text + size);
 
   // read parameters
 
   svm_model *model = Malloc(svm_model, 1);
+  memset(&model->param, 0, sizeof(model->param));
   model->rho = NULL;
   model->probA = NULL;
   model->probB = NULL;
   model->sv_indices = NULL;
   model->label = NULL;
   model->nSV = NULL;
+  model->sv_square = NULL;
+  model->mapping = NULL;
+  model->mapping_size = 0;
 
   // read header
-  if (!read_model_header(fp, model)) {
-    fprintf(stderr, "ERROR: fscanf failed to read model\n");
-    setlocale(LC_ALL, old_locale);
-    free(old_locale);
+  if (!read_model_header(in, model)) {
+    fprintf(stderr, "ERROR: failed to read model header\n");
+    free(text);
     free(model->rho);
     free(model->label);
+    free(model->probA);
+    free(model->probB);
     free(model->nSV);
     free(model);
     return NULL;
@@ -2429,70 +3610,267 @@ svm_model *svm_load_model(const char *model_file_name) {
 
   // read sv_coef and SV
 
-  int elements = 0;
-  long pos = ftell(fp);
+  model->free_sv = 1;  // XXX
+  bool ok = read_model_svs(in, model);
+  free(text);
+  if (!ok) {
+    svm_free_and_destroy_model(&model);
+    return NULL;
+  }
+  svm_compute_sv_square(model);
+  return model;
+}
 
-  max_line_len = 1024;
-  line = Malloc(char, max_line_len);
-  char *p, *endptr, *idx, *val;
+//
+// Binary model format
+//
+// A header followed by sections starting at multiples of BINARY_ALIGNMENT bytes, each holding an array exactly as
+// svm_model has it in memory: rho, label, probA, probB, nSV, the nr_class-1 rows of sv_coef, sv_square, the offset of each SV
+// in the node section, and the svm_node data of all SVs with their -1 terminators. Absent arrays have offset 0.
+//
+// svm_load_model_mmap maps the file read-only and points the model into it, so loading only allocates and fills the SV and
+// sv_coef pointer arrays. The format is native: files are only portable between machines with the same svm_node layout
+// and byte order, which the header records and the loader checks.
+//
+#define BINARY_MAGIC "LIBSVMB"
+#define BINARY_VERSION 1
+#define BINARY_ALIGNMENT 64
+#define BINARY_BYTE_ORDER 0x01020304u
+
+enum { BINARY_RHO, BINARY_LABEL, BINARY_PROB_A, BINARY_PROB_B, BINARY_NR_SV, BINARY_SV_COEF, BINARY_SV_SQUARE, BINARY_SV_START, BINARY_SV_NODES, BINARY_SECTIONS };
+
+struct binary_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t node_size;
+  int32_t svm_type;
+  int32_t kernel_type;
+  int32_t degree;
+  double gamma;
+  double coef0;
+  int32_t nr_class;
+  int32_t l;
+  uint64_t elements;  // number of svm_node in the node section
+  uint64_t file_size;
+  uint64_t offset[BINARY_SECTIONS];
+};
 
-  while (readline(fp) != NULL) {
-    p = strtok(line, ":");
-    while (1) {
-      p = strtok(NULL, ":");
-      if (p == NULL) break;
-      ++elements;
+static uint64_t binary_align(uint64_t offset) { return (offset + BINARY_ALIGNMENT - 1) / BINARY_ALIGNMENT * BINARY_ALIGNMENT; }
+
+// Section layout of a model with the given arrays present, returning the file size
+static uint64_t binary_layout(const svm_model *model, uint64_t elements, uint64_t *offset, uint64_t *size) {
+  // in 64 bits, as the loader passes the counts of the header here before trusting them
+  uint64_t nr_class = (uint64_t)model->nr_class;
+  uint64_t l = (uint64_t)model->l;
+  uint64_t nr_pair = nr_class * (nr_class - 1) / 2;
+  size[BINARY_RHO] = sizeof(double) * nr_pair;
+  size[BINARY_LABEL] = model->label ? sizeof(int) * nr_class : 0;
+  size[BINARY_PROB_A] = model->probA ? sizeof(double) * nr_pair : 0;
+  size[BINARY_PROB_B] = model->probB ? sizeof(double) * nr_pair : 0;
+  size[BINARY_NR_SV] = model->nSV ? sizeof(int) * nr_class : 0;
+  size[BINARY_SV_COEF] = sizeof(double) * (nr_class - 1) * l;
+  size[BINARY_SV_SQUARE] = model->sv_square ? sizeof(double) * l : 0;
+  size[BINARY_SV_START] = sizeof(uint64_t) * l;
+  size[BINARY_SV_NODES] = sizeof(svm_node) * elements;
+  uint64_t end = sizeof(binary_header);
+  for (int i = 0; i < BINARY_SECTIONS; i++) {
+    if (size[i] == 0) {
+      offset[i] = 0;
+      continue;
     }
+    offset[i] = binary_align(end);
+    end = offset[i] + size[i];
   }
-  elements += model->l;
+  return end;
+}
 
-  fseek(fp, pos, SEEK_SET);
+// Write size bytes of data at offset, padding with zeros from position
+static bool binary_write(FILE *fp, uint64_t &position, uint64_t offset, const void *data, uint64_t size) {
+  static const char padding[BINARY_ALIGNMENT] = {0};
+  if (size == 0) return true;
+  if (fwrite(padding, 1, offset - position, fp) != offset - position) return false;
+  position = offset + size;
+  return fwrite(data, 1, size, fp) == size;
+}
 
-  int m = model->nr_class - 1;
+int svm_save_model_binary(const char *model_file_name, const svm_model *model) {
+  int nr_class = model->nr_class;
   int l = model->l;
-  model->sv_coef = Malloc(double *, m);
-  int i;
-  for (i = 0; i < m; i++) model->sv_coef[i] = Malloc(double, l);
-  model->SV = Malloc(svm_node *, l);
-  svm_node *x_space = NULL;
-  if (l > 0) x_space = Malloc(svm_node, elements);
-
-  int j = 0;
-  for (i = 0; i < l; i++) {
-    readline(fp);
-    model->SV[i] = &x_space[j];
-
-    p = strtok(line, " \t");
-    model->sv_coef[0][i] = strtod(p, &endptr);
-    for (int k = 1; k < m; k++) {
-      p = strtok(NULL, " \t");
-      model->sv_coef[k][i] = strtod(p, &endptr);
-    }
+  uint64_t *sv_start = Malloc(uint64_t, l + 1);
+  sv_start[0] = 0;
+  for (int i = 0; i < l; i++) {
+    const svm_node *p = model->SV[i];
+    while (p->index != -1) p++;
+    sv_start[i + 1] = sv_start[i] + (p - model->SV[i] + 1);
+  }
+
+  binary_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  header.version = BINARY_VERSION;
+  header.byte_order = BINARY_BYTE_ORDER;
+  header.node_size = sizeof(svm_node);
+  header.svm_type = model->param.svm_type;
+  header.kernel_type = model->param.kernel_type;
+  header.degree = model->param.degree;
+  header.gamma = model->param.gamma;
+  header.coef0 = model->param.coef0;
+  header.nr_class = nr_class;
+  header.l = l;
+  header.elements = sv_start[l];
+  uint64_t size[BINARY_SECTIONS];
+  header.file_size = binary_layout(model, header.elements, header.offset, size);
+
+  FILE *fp = fopen(model_file_name, "wb");
+  if (fp == NULL) {
+    free(sv_start);
+    return -1;
+  }
+  uint64_t position = sizeof(header);
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  ok = ok && binary_write(fp, position, header.offset[BINARY_RHO], model->rho, size[BINARY_RHO]);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_LABEL], model->label, size[BINARY_LABEL]);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_PROB_A], model->probA, size[BINARY_PROB_A]);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_PROB_B], model->probB, size[BINARY_PROB_B]);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_NR_SV], model->nSV, size[BINARY_NR_SV]);
+  for (int k = 0; k < nr_class - 1; k++) ok = ok && binary_write(fp, position, header.offset[BINARY_SV_COEF] + sizeof(double) * k * l, model->sv_coef[k], sizeof(double) * l);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_SV_SQUARE], model->sv_square, size[BINARY_SV_SQUARE]);
+  ok = ok && binary_write(fp, position, header.offset[BINARY_SV_START], sv_start, size[BINARY_SV_START]);
+  for (int i = 0; i < l; i++) ok = ok && binary_write(fp, position, header.offset[BINARY_SV_NODES] + sizeof(svm_node) * sv_start[i], model->SV[i], sizeof(svm_node) * (sv_start[i + 1] - sv_start[i]));
+  free(sv_start);
+
+  if (!ok || ferror(fp) != 0) {
+    fclose(fp);
+    return -1;
+  }
+  return fclose(fp) != 0 ? -1 : 0;
+}
 
-    while (1) {
-      idx = strtok(NULL, ":");
-      val = strtok(NULL, " \t");
+// Returns NULL without a message if the file is not a binary model, so callers can fall back to svm_load_model
+svm_model *svm_load_model_mmap(const char *model_file_name) {
+  int fd = open(model_file_name, O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(binary_header)) {
+    close(fd);
+    return NULL;
+  }
+  size_t mapping_size = (size_t)st.st_size;
+  void *mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return NULL;
 
-      if (val == NULL) break;
-      x_space[j].index = (int)strtol(idx, &endptr, 10);
-      x_space[j].value = strtod(val, &endptr);
+  const char *base = (const char *)mapping;
+  const binary_header *header = (const binary_header *)base;
+  if (memcmp(header->magic, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0) {
+    munmap(mapping, mapping_size);
+    return NULL;
+  }
 
-      ++j;
+  // recompute the layout from the header to validate the offsets before trusting them, once the counts are small enough for
+  // the sizes of their arrays to fit the file, which also keeps those sizes from overflowing
+  uint64_t max_doubles = mapping_size / sizeof(double);
+  if (header->nr_class < 1 || header->l < 0 || (uint64_t)header->nr_class * (header->nr_class - 1) / 2 > max_doubles ||
+      (uint64_t)(header->nr_class - 1) * header->l > max_doubles || header->elements > mapping_size / sizeof(svm_node)) {
+    fprintf(stderr, "ERROR: incompatible or corrupted binary model\n");
+    munmap(mapping, mapping_size);
+    return NULL;
+  }
+  svm_model shape;
+  shape.nr_class = header->nr_class;
+  shape.l = header->l;
+  shape.label = header->offset[BINARY_LABEL] ? (int *)base : NULL;
+  shape.probA = header->offset[BINARY_PROB_A] ? (double *)base : NULL;
+  shape.probB = header->offset[BINARY_PROB_B] ? (double *)base : NULL;
+  shape.nSV = header->offset[BINARY_NR_SV] ? (int *)base : NULL;
+  shape.sv_square = header->offset[BINARY_SV_SQUARE] ? (double *)base : NULL;
+  uint64_t offset[BINARY_SECTIONS];
+  uint64_t size[BINARY_SECTIONS];
+  if (header->version != BINARY_VERSION || header->byte_order != BINARY_BYTE_ORDER || header->node_size != sizeof(svm_node) || header->file_size != mapping_size || binary_layout(&shape, header->elements, offset, size) != mapping_size || memcmp(offset, header->offset, sizeof(offset)) != 0) {
+    fprintf(stderr, "ERROR: incompatible or corrupted binary model\n");
+    munmap(mapping, mapping_size);
+    return NULL;
+  }
+  // every SV must start inside the node section and reach an index -1 before its end: with the last node a terminator,
+  // a row starting anywhere in the section ends inside it, and no other node may have a negative index
+  const uint64_t *sv_start = (const uint64_t *)(base + offset[BINARY_SV_START]);
+  const svm_node *sv_nodes = (const svm_node *)(base + offset[BINARY_SV_NODES]);
+  bool valid = header->l == 0 || (header->elements > 0 && sv_nodes[header->elements - 1].index == -1);
+  for (int i = 0; valid && i < header->l; i++)
+    if (sv_start[i] >= header->elements) valid = false;
+  for (uint64_t j = 0; valid && j < header->elements; j++)
+    if (sv_nodes[j].index < -1) valid = false;
+  // the model itself: known types, sv_square only for RBF, and for classification labels and SV counts summing to l, which
+  // prediction relies on to find the SVs of each class; other models have the single decision function of two classes
+  valid = valid && header->svm_type >= C_SVC && header->svm_type <= NU_SVR && header->kernel_type >= LINEAR && header->kernel_type <= PRECOMPUTED;
+  valid = valid && (offset[BINARY_SV_SQUARE] == 0 || header->kernel_type == RBF);
+  if (valid && (header->svm_type == C_SVC || header->svm_type == NU_SVC)) {
+    const int *nSV = (const int *)(base + offset[BINARY_NR_SV]);
+    valid = offset[BINARY_LABEL] != 0 && offset[BINARY_NR_SV] != 0;
+    int64_t total = 0;
+    for (int i = 0; valid && i < header->nr_class; i++) {
+      if (nSV[i] < 0) valid = false;
+      total += nSV[i];
     }
-    x_space[j++].index = -1;
+    valid = valid && total == header->l;
+  } else if (valid) {
+    valid = header->nr_class == 2;
+  }
+  if (!valid) {
+    fprintf(stderr, "ERROR: incompatible or corrupted binary model\n");
+    munmap(mapping, mapping_size);
+    return NULL;
   }
-  free(line);
-
-  setlocale(LC_ALL, old_locale);
-  free(old_locale);
-
-  if (ferror(fp) != 0 || fclose(fp) != 0) return NULL;
 
-  model->free_sv = 1;  // XXX
+  int nr_class = header->nr_class;
+  int l = header->l;
+  svm_model *model = Malloc(svm_model, 1);
+  memset(&model->param, 0, sizeof(model->param));
+  model->param.svm_type = header->svm_type;
+  model->param.kernel_type = header->kernel_type;
+  model->param.degree = header->degree;
+  model->param.gamma = header->gamma;
+  model->param.coef0 = header->coef0;
+  model->nr_class = nr_class;
+  model->l = l;
+  model->rho = (double *)(base + offset[BINARY_RHO]);
+  model->label = offset[BINARY_LABEL] ? (int *)(base + offset[BINARY_LABEL]) : NULL;
+  model->probA = offset[BINARY_PROB_A] ? (double *)(base + offset[BINARY_PROB_A]) : NULL;
+  model->probB = offset[BINARY_PROB_B] ? (double *)(base + offset[BINARY_PROB_B]) : NULL;
+  model->nSV = offset[BINARY_NR_SV] ? (int *)(base + offset[BINARY_NR_SV]) : NULL;
+  model->sv_square = offset[BINARY_SV_SQUARE] ? (double *)(base + offset[BINARY_SV_SQUARE]) : NULL;
+  model->sv_indices = NULL;
+  model->sv_coef = Malloc(double *, nr_class - 1);
+  for (int k = 0; k < nr_class - 1; k++) model->sv_coef[k] = (double *)(base + offset[BINARY_SV_COEF]) + (long int)k * l;
+  model->SV = Malloc(svm_node *, l);
+  svm_node *nodes = (svm_node *)(base + offset[BINARY_SV_NODES]);
+  for (int i = 0; i < l; i++) model->SV[i] = nodes + sv_start[i];
+  model->free_sv = 1;
+  model->mapping = mapping;
+  model->mapping_size = mapping_size;
   return model;
 }
 
 void svm_free_model_content(svm_model *model_ptr) {
+  if (model_ptr->mapping != NULL) {
+    // everything but the pointer arrays lives in the mapping
+    free(model_ptr->SV);
+    free(model_ptr->sv_coef);
+    munmap(model_ptr->mapping, model_ptr->mapping_size);
+    model_ptr->SV = NULL;
+    model_ptr->sv_coef = NULL;
+    model_ptr->sv_square = NULL;
+    model_ptr->rho = NULL;
+    model_ptr->label = NULL;
+    model_ptr->probA = NULL;
+    model_ptr->probB = NULL;
+    model_ptr->sv_indices = NULL;
+    model_ptr->nSV = NULL;
+    model_ptr->mapping = NULL;
+    model_ptr->mapping_size = 0;
+    return;
+  }
   if (model_ptr->free_sv && model_ptr->l > 0 && model_ptr->SV != NULL) free((void *)(model_ptr->SV[0]));
   if (model_ptr->sv_coef) {
     for (int i = 0; i < model_ptr->nr_class - 1; i++) free(model_ptr->sv_coef[i]);
@@ -2501,6 +3879,9 @@ void svm_free_model_content(svm_model *model_ptr) {
   free(model_ptr->SV);
   model_ptr->SV = NULL;
 
+  free(model_ptr->sv_square);
+  model_ptr->sv_square = NULL;
+
   free(model_ptr->sv_coef);
   model_ptr->sv_coef = NULL;
 
@@ -2570,6 +3951,35 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
 
   if (param->probability != 0 && param->probability != 1) return "probability != 0 and probability != 1";
 
+  if (param->nr_thread < 0) return "nr_thread < 0";
+
+  if (param->sv_budget < 0) return "sv_budget < 0";
+
+  if (param->pair_sv_budget < 0) return "pair_sv_budget < 0";
+
+  if ((param->sv_budget > 0 || param->pair_sv_budget > 0) && svm_type != C_SVC) return "SV budgets are only supported for C_SVC";
+
+  if (param->pair_sv_budget == 1) return "pair_sv_budget < 2, which cannot keep both classes";
+
+  if (param->sv_budget > 0) {
+    // every class keeps at least one SV
+    int nr_label = 0;
+    int *label = Malloc(int, prob->l);
+    for (int i = 0; i < prob->l; i++) {
+      int j;
+      for (j = 0; j < nr_label && label[j] != (int)prob->y[i]; j++);
+      if (j == nr_label) label[nr_label++] = (int)prob->y[i];
+    }
+    free(label);
+    if (param->sv_budget < nr_label) return "sv_budget < number of classes";
+  }
+
+  if (prob->W != NULL) {
+    if (svm_type != C_SVC) return "instance weights are only supported for C_SVC";
+    for (int i = 0; i < prob->l; i++)
+      if (!(prob->W[i] > 0)) return "instance weight <= 0";
+  }
+
   if (param->probability == 1 && svm_type == ONE_CLASS) return "one-class SVM probability output not supported yet";
 
   // check whether nu-svc is feasible
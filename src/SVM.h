@@ -1,7 +1,12 @@
 #ifndef _LIBSVM_H
 #define _LIBSVM_H
 
-#define LIBSVM_VERSION 323
+/* 324 added fields to svm_problem and svm_parameter, which callers filling them in by hand must now set too: zero-initializing them,
+ * as with "struct svm_parameter param = {0};", gives the behavior of 323 */
+#define LIBSVM_VERSION 324
+
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,19 +14,28 @@ extern "C" {
 
 extern int libsvm_version;
 
+/* feature and SV values are float when built with LIBSVM_FLOAT_VALUES, halving their memory; the solver still works in double */
+#ifdef LIBSVM_FLOAT_VALUES
+typedef float svm_value;
+#else
+typedef double svm_value;
+#endif
+
 struct svm_node {
   int index;
-  double value;
+  svm_value value;
 };
 
 struct svm_problem {
   int l;
   double *y;
   struct svm_node **x;
+  double *W; /* since 324: instance weights (W[l]) multiplying C, for C_SVC, NULL for all 1 */
 };
 
 enum { C_SVC, NU_SVC, ONE_CLASS, EPSILON_SVR, NU_SVR }; /* svm_type */
 enum { LINEAR, POLY, RBF, SIGMOID, PRECOMPUTED };       /* kernel_type */
+enum { MAX_WINS, EARLY_EXIT, DAG };                     /* decision_mode */
 
 struct svm_parameter {
   int svm_type;
@@ -41,6 +55,10 @@ struct svm_parameter {
   double p;          /* for EPSILON_SVR */
   int shrinking;     /* use the shrinking heuristics */
   int probability;   /* do probability estimates */
+  int nr_thread;     /* since 324: threads of svm_cross_validation_parallel, 0 for one per core, and of probability estimates if > 1 */
+  unsigned long seed; /* since 324: for the shuffles of cross validation and probability estimates, which no longer use rand() */
+  int sv_budget;      /* since 324: for C_SVC, most SVs of the model, 0 for no limit */
+  int pair_sv_budget; /* since 324: for C_SVC, most SVs of each binary classifier, 0 for no limit */
 };
 
 //
@@ -51,6 +69,7 @@ struct svm_model {
   int nr_class;               /* number of classes, = 2 in regression/one class svm */
   int l;                      /* total #SV */
   struct svm_node **SV;       /* SVs (SV[l]) */
+  double *sv_square;          /* squared norms of the SVs (sv_square[l]) for RBF, NULL otherwise */
   double **sv_coef;           /* coefficients for SVs in decision functions (sv_coef[k-1][l]) */
   double *rho;                /* constants in decision functions (rho[k*(k-1)/2]) */
   double *probA;              /* pariwise probability information */
@@ -65,23 +84,54 @@ struct svm_model {
   /* XXX */
   int free_sv; /* 1 if svm_model is created by svm_load_model*/
                /* 0 if svm_model is created by svm_train */
+
+  void *mapping;       /* file mapped by svm_load_model_mmap, which the arrays above point into, NULL otherwise */
+  size_t mapping_size; /* length of mapping in bytes */
+};
+
+//
+// svm_workspace
+//
+// scratch space of svm_predict_values_workspace and svm_predict_mode_workspace, so repeated predictions need no allocation
+//
+struct svm_workspace {
+  int *start;     /* index of the first SV of each class (start[k]), see svm_get_sv_start */
+  double *kvalue; /* kernel values (kvalue[l]) */
+  int *vote;      /* votes of each class (vote[k]) */
+  int *lost;      /* defeats of each class (lost[k]) for EARLY_EXIT, may be NULL otherwise */
+  char *ready;    /* classes whose kernel values are in kvalue (ready[k]) for DAG, may be NULL otherwise */
+  char *played;   /* pairs of classes played (played[k*k]) for EARLY_EXIT, may be NULL otherwise */
 };
 
 struct svm_model *svm_train(const struct svm_problem *prob, const struct svm_parameter *param);
 void svm_cross_validation(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
+void svm_cross_validation_parallel(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
+/* copy of model which owns its SVs, with the identical SVs of each class merged and the SVs whose coefficients are all below tolerance in magnitude dropped */
+struct svm_model *svm_compact_model(const struct svm_model *model, double tolerance);
+/* whether two rows have the same indices and values, and a hash of a row that is the same for such rows */
+int svm_same_row(const struct svm_node *x, const struct svm_node *y);
+uint64_t svm_hash_row(const struct svm_node *x);
 
 int svm_save_model(const char *model_file_name, const struct svm_model *model);
 struct svm_model *svm_load_model(const char *model_file_name);
+int svm_save_model_binary(const char *model_file_name, const struct svm_model *model);
+struct svm_model *svm_load_model_mmap(const char *model_file_name);
 
 int svm_get_svm_type(const struct svm_model *model);
 int svm_get_nr_class(const struct svm_model *model);
 void svm_get_labels(const struct svm_model *model, int *label);
 void svm_get_sv_indices(const struct svm_model *model, int *sv_indices);
 int svm_get_nr_sv(const struct svm_model *model);
+void svm_get_sv_start(const struct svm_model *model, int *start);
 double svm_get_svr_probability(const struct svm_model *model);
 
 double svm_predict_values(const struct svm_model *model, const struct svm_node *x, double *dec_values);
+double svm_predict_values_workspace(const struct svm_model *model, const struct svm_node *x, double *dec_values, struct svm_workspace *workspace);
 double svm_predict(const struct svm_model *model, const struct svm_node *x);
+double svm_predict_mode(const struct svm_model *model, const struct svm_node *x, int decision_mode);
+/* dec_values are only filled with MAX_WINS, as the other modes leave pairs out */
+double svm_predict_mode_workspace(const struct svm_model *model, const struct svm_node *x, int decision_mode, double *dec_values, struct svm_workspace *workspace);
+void svm_predict_batch(const struct svm_model *model, const struct svm_node *const *x, int n, double *predictions, double *dec_values);
 double svm_predict_probability(const struct svm_model *model, const struct svm_node *x, double *prob_estimates);
 
 void svm_free_model_content(struct svm_model *model_ptr);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Owns a file descriptor and closes it when destroyed.
+class FileDescriptor {
+  int descriptor = -1;
+
+ public:
+  FileDescriptor() = default;
+  explicit FileDescriptor(int descriptor) : descriptor(descriptor) {}
+  FileDescriptor(FileDescriptor &&other) noexcept : descriptor(std::exchange(other.descriptor, -1)) {}
+  FileDescriptor &operator=(FileDescriptor &&other) noexcept {
+    if (this != &other) {
+      reset();
+      descriptor = std::exchange(other.descriptor, -1);
+    }
+    return *this;
+  }
+  FileDescriptor(const FileDescriptor &) = delete;
+  FileDescriptor &operator=(const FileDescriptor &) = delete;
+  ~FileDescriptor() { reset(); }
+
+  int get() const { return descriptor; }
+  void reset() {
+    if (descriptor != -1) close(descriptor);
+    descriptor = -1;
+  }
+};
+
+inline std::runtime_error systemError(const std::string &what) { return std::runtime_error(what + ": " + std::strerror(errno) + "."); }
+
+inline sockaddr_un unixSocketAddress(const std::string &path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) throw std::invalid_argument("The socket path " + path + " is too long.");
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+// Creates a Unix domain stream socket listening on path, replacing any socket file left there.
+inline FileDescriptor listenOnUnixSocket(const std::string &path) {
+  const sockaddr_un address = unixSocketAddress(path);
+  FileDescriptor socket(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (socket.get() == -1) throw systemError("Could not create a socket");
+  unlink(path.c_str());
+  if (bind(socket.get(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) throw systemError("Could not bind " + path);
+  if (listen(socket.get(), SOMAXCONN) == -1) throw systemError("Could not listen on " + path);
+  return socket;
+}
+
+inline FileDescriptor connectToUnixSocket(const std::string &path) {
+  const sockaddr_un address = unixSocketAddress(path);
+  FileDescriptor socket(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (socket.get() == -1) throw systemError("Could not create a socket");
+  if (connect(socket.get(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) throw systemError("Could not connect to " + path);
+  return socket;
+}
+
+// Reads exactly size bytes, returning false if the peer closed the connection before the first one.
+inline bool readFully(int descriptor, void *buffer, size_t size) {
+  auto *bytes = static_cast<unsigned char *>(buffer);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t count = read(descriptor, bytes + done, size - done);
+    if (count == -1 && errno == EINTR) continue;
+    if (count == -1) throw systemError("Could not read from a socket");
+    if (count == 0) {
+      if (done == 0) return false;
+      throw std::runtime_error("The connection was closed in the middle of a message.");
+    }
+    done += static_cast<size_t>(count);
+  }
+  return true;
+}
+
+inline void writeFully(int descriptor, const void *buffer, size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(buffer);
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t count = send(descriptor, bytes + done, size - done, MSG_NOSIGNAL);
+    if (count == -1 && errno == EINTR) continue;
+    if (count == -1) throw systemError("Could not write to a socket");
+    done += static_cast<size_t>(count);
+  }
+}
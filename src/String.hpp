@@ -11,6 +11,13 @@ inline int stringToInteger(const std::string &string) {
   return integer;
 }
 
+inline double stringToDouble(const std::string &string) {
+  std::stringstream ss(string);
+  double value;
+  ss >> value;
+  return value;
+}
+
 inline std::string toString(double value, int digits) {
   std::stringstream ss;
   ss << std::fixed << std::setprecision(digits) << value;